@@ -1,13 +1,41 @@
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__linux__) || defined(ART_COMPACT_REFS)
+#include <sys/mman.h>
+#endif
+#ifdef ART_COMPACT_REFS
+#include <unistd.h>
+#endif
 #include "art.h"
 
+/**
+ * Prefix bytes stored in each node. Builds with
+ * ART_HYBRID_PREFIX keep longer prefixes out of line,
+ * whole, and use the space for a pointer to them.
+ */
+#ifndef MAX_PREFIX_LEN
 #define MAX_PREFIX_LEN 10
+#endif
+
+#if defined(ART_HYBRID_PREFIX) && MAX_PREFIX_LEN < 8
+#error "ART_HYBRID_PREFIX needs a MAX_PREFIX_LEN of at least 8"
+#endif
 
 #define NODE4   1
 #define NODE16  2
 #define NODE48  3
 #define NODE256 4
+#define NODE32  5
+#define NODE64  6
+#define NODE_MAX NODE64
+
+// Leaf buckets come from the leaf allocator, and are
+// not counted as nodes
+#define NODEB   7
 
 /**
  * Macros to manipulate pointer tags
@@ -17,152 +45,1242 @@
 #define LEAF_RAW(x) ((art_leaf*)((void*)((uintptr_t)x >> 1 << 1)))
 
 /**
- * This struct is included as part of all the various node sizes
+ * This struct is included as part of all the various node sizes.
+ * rep is some leaf below the node, to read the prefix bytes
+ * the node does not store without a walk down to a leaf. It
+ * is the own leaf of the node, the leaf of the key ending at
+ * the node, when the node has one, and then tagged OWN_LEAF.
+ */
+typedef struct {
+    uint32_t partial_len;
+    uint8_t type;
+    uint8_t num_children;
+    unsigned char partial[MAX_PREFIX_LEN];
+    art_leaf *rep;
+} art_node;
+
+/**
+ * Reference to a child, a node or a tagged leaf.
+ *
+ * Builds with ART_COMPACT_REFS keep every node and leaf
+ * of a tree in one reserved address range, and a child is
+ * a 32-bit offset into it in units of 8 bytes. Everything
+ * in the range is 16-byte aligned, so bit 0 of a reference
+ * is still free for the leaf tag, and 0 is NULL.
+ */
+#ifdef ART_COMPACT_REFS
+typedef uint32_t art_ref;
+
+#define ART_ALIGN 16
+
+static inline art_node* ref_to_ptr(const unsigned char *base, art_ref r) {
+    if (!r) return NULL;
+    return (art_node*)((uintptr_t)(base + ((uintptr_t)(r >> 1) << 4)) | (r & 1));
+}
+
+static inline art_ref ptr_to_ref(const unsigned char *base, const void *p) {
+    if (!p) return 0;
+    return (art_ref)(((const unsigned char*)LEAF_RAW(p) - base) >> 3) | IS_LEAF(p);
+}
+
+#define REF_PTR(t, r) ref_to_ptr((t)->arena->base, (r))
+#define PTR_REF(t, p) ptr_to_ref((t)->arena->base, (p))
+#else
+typedef art_node* art_ref;
+
+#define ART_ALIGN 8
+
+#define REF_PTR(t, r) ((void)(t), (r))
+#define PTR_REF(t, p) ((void)(t), (art_node*)(p))
+#endif
+
+/**
+ * Small node with only 4 children. ART_FINGERPRINTS builds
+ * keep a fingerprint of the key of each leaf child in fps,
+ * in the padding before the children.
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[4];
+#ifdef ART_FINGERPRINTS
+    unsigned char fps[4];
+#endif
+    art_ref children[4];
+} art_node4;
+
+/**
+ * Node with 16 children, with leaf fingerprints
+ * like Node4
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[16];
+#ifdef ART_FINGERPRINTS
+    unsigned char fps[16];
+#endif
+    art_ref children[16];
+} art_node16;
+
+/**
+ * Node with 32 children, searched
+ * with a single AVX2 compare
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[32];
+    art_ref children[32];
+} art_node32;
+
+/**
+ * Node with 64 children, searched
+ * with a single AVX-512 compare
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[64];
+    art_ref children[64];
+} art_node64;
+
+/**
+ * Node with 48 children, but
+ * a full 256 byte field. Bit i of slots
+ * is set when children[i] is in use, and
+ * present is the bitmap of the used keys.
+ */
+typedef struct {
+    art_node n;
+    unsigned char keys[256];
+    uint64_t slots;
+    uint64_t present[4];
+    art_ref children[48];
+} art_node48;
+
+/**
+ * Full node with 256 children, present
+ * is the bitmap of the used keys.
+ */
+typedef struct {
+    art_node n;
+    uint64_t present[4];
+    art_ref children[256];
+} art_node256;
+
+/**
+ * Most leaves in a bucket, longest key a bucket takes, and
+ * longest part of a key past the depth of its bucket. The
+ * entries keep their whole keys, so buckets only go where
+ * little of a key is left to tell its leaves apart.
+ */
+#ifndef ART_BUCKET_MAX
+#define ART_BUCKET_MAX 16
+#endif
+#ifndef ART_BUCKET_KEY_MAX
+#define ART_BUCKET_KEY_MAX 64
+#endif
+#ifndef ART_BUCKET_SUFFIX_MAX
+#define ART_BUCKET_SUFFIX_MAX 16
+#endif
+
+/**
+ * Leaf bucket, the leaves of a subtree packed in key order,
+ * each one laid out like an art_leaf and 8-byte aligned.
+ * A bucket has no prefix, and num_children counts its
+ * leaves. The first leaf stays at the same address for
+ * the life of the bucket, and is its representative leaf.
+ */
+typedef struct {
+    art_node n;
+    uint32_t size;
+    uint32_t used;
+    unsigned char entries[];
+} art_bucket;
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* From public domain
+ * https://graphics.stanford.edu/~seander/bithacks.html
+ *
+ * Bit twiddling:
+ * contains_byte:  __builtin_ctz:  for key index:
+ *    0x80000000            0x20               3
+ *      0x800000            0x18               2
+ *      0x808000            0x10               1
+ *          0x80             0x8               0
+ *           0x0             0x0       not found
+ */
+static inline uint32_t word_has_byte(uint32_t v, unsigned char c, uint32_t num) {
+    v = (v ^ (0x01010101UL * c)) | ((~0ULL) << (num << 3));
+    return (v - 0x01010101UL) & ~v & 0x80808080UL;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ART_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+/**
+ * Kernels searching the keys of the nodes with sorted keys.
+ * find returns the index of c among the first num keys, or
+ * -1, and lower the index c goes at to keep them sorted.
+ * mismatch returns the index of the first byte at which
+ * two keys of len bytes differ, or len (0 if len < 0).
+ * A set of them is picked for the CPU once at load time.
+ */
+typedef struct {
+    int (*find4)(const unsigned char *keys, unsigned char c, int num);
+    int (*lower4)(const unsigned char *keys, unsigned char c, int num);
+    int (*find16)(const unsigned char *keys, unsigned char c, int num);
+    int (*lower16)(const unsigned char *keys, unsigned char c, int num);
+    int (*find32)(const unsigned char *keys, unsigned char c, int num);
+    int (*find64)(const unsigned char *keys, unsigned char c, int num);
+    int (*mismatch)(const unsigned char *a, const unsigned char *b, int len);
+} art_kernels;
+
+static int find_scalar(const unsigned char *keys, unsigned char c, int num) {
+    for (int i = 0; i < num; i++)
+        if (keys[i] == c)
+            return i;
+    return -1;
+}
+
+static int lower_scalar(const unsigned char *keys, unsigned char c, int num) {
+    int idx = 0;
+    while (idx < num && keys[idx] < c) idx++;
+    return idx;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/**
+ * Node4 keys fit a word, compare them all at once
+ */
+static int find4_swar(const unsigned char *keys, unsigned char c, int num) {
+    uint32_t v;
+    memcpy(&v, keys, 4);
+    uint32_t bitfield = word_has_byte(v, c, num);
+    return bitfield ? __builtin_ctz(bitfield) >> 3 : -1;
+}
+
+/**
+ * Subtracts each key from c in its own 16 bit lane, the
+ * lanes that borrow hold the keys bigger than c.
+ */
+static int lower4_swar(const unsigned char *keys, unsigned char c, int num) {
+    uint64_t cmp = ((0x0001000100010001ULL * c) | 0x1000100010001000ULL) -
+            (((uint64_t)keys[0]) | ((uint64_t)keys[1]) << 16 |
+             ((uint64_t)keys[2]) << 32 | ((uint64_t)keys[3]) << 48);
+    uint64_t mask = (1ULL << (num << 4)) - 1;
+    uint64_t bitfield = ((cmp & 0x1000100010001000ULL) ^ 0x1000100010001000ULL) & mask;
+    return bitfield ? __builtin_ctzll(bitfield) >> 4 : num;
+}
+#else
+#define find4_swar find_scalar
+#define lower4_swar lower_scalar
+#endif
+
+/**
+ * Compares the keys 8 bytes at a time, the first differing
+ * byte being the lowest set byte of the xor of the words.
+ */
+static inline int mismatch_words(const unsigned char *a, const unsigned char *b, int i, int len) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            return i + (__builtin_ctzll(x ^ y) >> 3);
+    }
+#endif
+    for (; i < len; i++)
+        if (a[i] != b[i])
+            return i;
+    return i;
+}
+
+static int mismatch_scalar(const unsigned char *a, const unsigned char *b, int len) {
+    return mismatch_words(a, b, 0, len);
+}
+
+#ifdef ART_X86_DISPATCH
+__attribute__((target("sse2")))
+static int mismatch_sse2(const unsigned char *a, const unsigned char *b, int len) {
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                _mm_loadu_si128((const __m128i*)(b + i)));
+        uint32_t bitfield = _mm_movemask_epi8(cmp) ^ 0xffff;
+        if (bitfield)
+            return i + __builtin_ctz(bitfield);
+    }
+    return mismatch_words(a, b, i, len);
+}
+
+__attribute__((target("avx2")))
+static int mismatch_avx2(const unsigned char *a, const unsigned char *b, int len) {
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i cmp = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                _mm256_loadu_si256((const __m256i*)(b + i)));
+        uint32_t bitfield = ~(uint32_t)_mm256_movemask_epi8(cmp);
+        if (bitfield)
+            return i + __builtin_ctz(bitfield);
+    }
+    if (i + 16 <= len) {
+        __m128i cmp = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                _mm_loadu_si128((const __m128i*)(b + i)));
+        uint32_t bitfield = _mm_movemask_epi8(cmp) ^ 0xffff;
+        if (bitfield)
+            return i + __builtin_ctz(bitfield);
+        i += 16;
+    }
+    return mismatch_words(a, b, i, len);
+}
+
+__attribute__((target("sse2")))
+static int find4_sse2(const unsigned char *keys, unsigned char c, int num) {
+    int32_t v;
+    memcpy(&v, keys, 4);
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c), _mm_cvtsi32_si128(v));
+    uint32_t bitfield = _mm_movemask_epi8(cmp) & ((1U << num) - 1);
+    return bitfield ? __builtin_ctz(bitfield) : -1;
+}
+
+__attribute__((target("sse2")))
+static int lower4_sse2(const unsigned char *keys, unsigned char c, int num) {
+    int32_t v;
+    memcpy(&v, keys, 4);
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i cmp = _mm_cmplt_epi8(_mm_xor_si128(_mm_set1_epi8(c), bias),
+            _mm_xor_si128(_mm_cvtsi32_si128(v), bias));
+    uint32_t bitfield = _mm_movemask_epi8(cmp) & ((1U << num) - 1);
+    return bitfield ? __builtin_ctz(bitfield) : num;
+}
+
+__attribute__((target("sse2")))
+static int find16_sse2(const unsigned char *keys, unsigned char c, int num) {
+    // Compare the key to all 16 stored keys
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
+            _mm_loadu_si128((const __m128i*)keys));
+
+    // Use a mask to ignore children that don't exist
+    uint32_t mask = (1UL << num) - 1;
+    uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
+    return bitfield ? __builtin_ctz(bitfield) : -1;
+}
+
+__attribute__((target("sse2")))
+static int lower16_sse2(const unsigned char *keys, unsigned char c, int num) {
+    // Flip the sign bits, so the signed compare orders bytes unsigned
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i cmp = _mm_cmplt_epi8(_mm_xor_si128(_mm_set1_epi8(c), bias),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)keys), bias));
+
+    // The first key bigger than c, or the end
+    uint32_t mask = (1UL << num) - 1;
+    uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
+    return bitfield ? __builtin_ctz(bitfield) : num;
+}
+
+__attribute__((target("avx2")))
+static int find32_avx2(const unsigned char *keys, unsigned char c, int num) {
+    __m256i cmp = _mm256_cmpeq_epi8(_mm256_set1_epi8(c),
+            _mm256_loadu_si256((const __m256i*)keys));
+    uint32_t mask = (num == 32) ? ~0U : (1U << num) - 1;
+    uint32_t bitfield = (uint32_t)_mm256_movemask_epi8(cmp) & mask;
+    return bitfield ? __builtin_ctz(bitfield) : -1;
+}
+
+__attribute__((target("avx2")))
+static int find64_avx2(const unsigned char *keys, unsigned char c, int num) {
+    __m256i k = _mm256_set1_epi8(c);
+    uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(k,
+            _mm256_loadu_si256((const __m256i*)keys)));
+    uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(k,
+            _mm256_loadu_si256((const __m256i*)(keys + 32))));
+    uint64_t mask = (num == 64) ? ~0ULL : (1ULL << num) - 1;
+    uint64_t bitfield = (lo | hi << 32) & mask;
+    return bitfield ? __builtin_ctzll(bitfield) : -1;
+}
+
+__attribute__((target("avx512bw")))
+static int find64_avx512(const unsigned char *keys, unsigned char c, int num) {
+    uint64_t mask = (num == 64) ? ~0ULL : (1ULL << num) - 1;
+    uint64_t bitfield = _mm512_cmpeq_epi8_mask(_mm512_set1_epi8(c),
+            _mm512_loadu_si512((const void*)keys)) & mask;
+    return bitfield ? __builtin_ctzll(bitfield) : -1;
+}
+#endif
+
+static const art_kernels kernel_sets[ART_SIMD_AVX512+1] = {
+    { find4_swar, lower4_swar, find_scalar, lower_scalar, find_scalar, find_scalar, mismatch_scalar },
+#ifdef ART_X86_DISPATCH
+    { find4_sse2, lower4_sse2, find16_sse2, lower16_sse2, find_scalar, find_scalar, mismatch_sse2 },
+    { find4_sse2, lower4_sse2, find16_sse2, lower16_sse2, find32_avx2, find64_avx2, mismatch_avx2 },
+    { find4_sse2, lower4_sse2, find16_sse2, lower16_sse2, find32_avx2, find64_avx512, mismatch_avx2 },
+#endif
+};
+
+static art_kernels kernels = {
+    find4_swar, lower4_swar, find_scalar, lower_scalar, find_scalar, find_scalar, mismatch_scalar
+};
+
+/**
+ * Index of the first byte at which two keys differ, or len.
+ * Short runs, like the stored prefixes, are compared inline.
+ */
+static inline int key_mismatch(const unsigned char *a, const unsigned char *b, int len) {
+    if (len < 16)
+        return mismatch_words(a, b, 0, len);
+    return kernels.mismatch(a, b, len);
+}
+
+/**
+ * Kernel set in use, and the best one the CPU can run,
+ * -1 until the CPU has been looked at.
+ */
+static int simd_level = ART_SIMD_SCALAR;
+static int cpu_level = -1;
+
+static int simd_level_from_name(const char *name) {
+    static const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+    for (int i = ART_SIMD_SCALAR; i <= ART_SIMD_AVX512; i++)
+        if (!strcmp(name, names[i]))
+            return i;
+    return ART_SIMD_AUTO;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void init_kernels(void) {
+    int level = ART_SIMD_SCALAR;
+#ifdef ART_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        level = ART_SIMD_SSE2;
+    if (level == ART_SIMD_SSE2 && __builtin_cpu_supports("avx2"))
+        level = ART_SIMD_AVX2;
+    if (level == ART_SIMD_AVX2 && __builtin_cpu_supports("avx512bw"))
+        level = ART_SIMD_AVX512;
+#endif
+    cpu_level = level;
+
+    // ART_SIMD=scalar|sse2|avx2|avx512 picks a kernel set
+    const char *env = getenv("ART_SIMD");
+    if (!env || art_simd_force(simd_level_from_name(env)))
+        art_simd_force(ART_SIMD_AUTO);
+}
+
+/**
+ * Selects the SIMD kernels used by all trees.
+ * @return 0 on success, -1 if the CPU cannot run them.
+ */
+int art_simd_force(int level) {
+    if (cpu_level < 0)
+        init_kernels();
+    if (level == ART_SIMD_AUTO)
+        level = cpu_level;
+    if (level < ART_SIMD_SCALAR || level > cpu_level)
+        return -1;
+    kernels = kernel_sets[level];
+    simd_level = level;
+    return 0;
+}
+
+/**
+ * Returns the ART_SIMD_* level of the kernels in use.
+ */
+int art_simd_level(void) {
+    if (cpu_level < 0)
+        init_kernels();
+    return simd_level;
+}
+
+/**
+ * 256-bit key presence bitmaps of Node48 and Node256
+ */
+static inline void bitmap_set(uint64_t *b, unsigned char c) {
+    b[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline void bitmap_clear(uint64_t *b, unsigned char c) {
+    b[c >> 6] &= ~(1ULL << (c & 63));
+}
+
+// First key at or after i, 256 if there is none
+static inline int bitmap_next(const uint64_t *b, int i) {
+    while (i < 256) {
+        uint64_t w = b[i >> 6] >> (i & 63);
+        if (w) return i + __builtin_ctzll(w);
+        i = (i | 63) + 1;
+    }
+    return 256;
+}
+
+// Last key, -1 if there is none
+static inline int bitmap_last(const uint64_t *b) {
+    for (int w = 3; w >= 0; w--)
+        if (b[w]) return (w << 6) + 63 - __builtin_clzll(b[w]);
+    return -1;
+}
+
+/**
+ * Nodes are aligned to a cache line of this size
+ */
+#ifndef ART_CACHE_LINE
+#define ART_CACHE_LINE 64
+#endif
+
+/**
+ * Size of the slabs the arena carves nodes out of
+ */
+#define ART_SLAB_SIZE (64 * 1024)
+
+/**
+ * Size of the slabs of huge page trees, one huge page
+ */
+#define ART_HUGE_SLAB_SIZE (2 * 1024 * 1024)
+
+/**
+ * Slab header, the node memory follows it
+ */
+typedef struct art_slab {
+    struct art_slab *next;
+    uint64_t pad;
+} art_slab;
+
+/**
+ * Header of a block too big for a slab. These are
+ * allocated one by one but stay linked to the arena,
+ * so a region can still be released without a walk.
+ */
+typedef struct art_big {
+    struct art_big *next;
+    struct art_big *prev;
+    size_t size;
+    uint64_t pad;
+} art_big;
+
+/**
+ * Leaves at least this big get a block of their own
+ */
+#define ART_BIG_SIZE (ART_SLAB_SIZE / 8)
+
+/**
+ * Pooled leaves are rounded up to a multiple of the
+ * class size, and have a free list per size class.
+ */
+#define ART_LEAF_CLASS_SIZE 16
+#define ART_LEAF_CLASSES    64
+
+/**
+ * Most nodes a tree without a node arena keeps cached per type
+ */
+#ifndef ART_NODE_CACHE_MAX
+#define ART_NODE_CACHE_MAX 64
+#endif
+
+#ifdef ART_COMPACT_REFS
+/**
+ * Address range reserved for each tree of a compact build.
+ * Only the pages in use are backed by memory, and 32-bit
+ * references reach 32 GB. Smaller ranges are tried when
+ * the reservation fails.
+ */
+#ifndef ART_COMPACT_RESERVE
+#define ART_COMPACT_RESERVE ((size_t)32 << 30)
+#endif
+#endif
+
+#define NODES_IN_ARENA(t)  ((t)->flags & (ART_TREE_ARENA | ART_TREE_REGION))
+#define NODES_CACHED(t)    ((t)->flags & (ART_TREE_ARENA | ART_TREE_REGION | ART_TREE_NODE_CACHE))
+#define LEAVES_IN_ARENA(t) ((t)->flags & (ART_TREE_REGION | ART_TREE_LEAF_POOL))
+
+/**
+ * Per-tree node arena. Nodes are bump allocated from
+ * slabs, and freed nodes are kept on a free list per
+ * node type, linked through their first word. Trees that
+ * only cache nodes keep a bounded number of allocator
+ * nodes on the same lists. Pooled
+ * leaves are recycled the same way through a free list per
+ * size class. In region mode all the leaves live in the
+ * arena, and slabs kept for reuse by art_tree_clear sit on
+ * the spare list. Compact builds carve slabs and big blocks
+ * out of the reserved range from base to limit, and keep
+ * freed big blocks on a first fit list.
+ */
+struct art_arena {
+    art_slab *slabs;
+    art_slab *spare;
+    art_big *big;
+#ifdef ART_COMPACT_REFS
+    unsigned char *base;
+    unsigned char *top;
+    unsigned char *limit;
+    art_big *big_free;
+#endif
+    size_t slab_size;
+    unsigned char *cur;
+    unsigned char *end;
+    void *free_nodes[NODE_MAX+1];
+    void *free_leaves[ART_LEAF_CLASSES+1];
+    uint32_t cached[NODE_MAX+1];
+    uint64_t hits[NODE_MAX+1];
+    uint64_t misses[NODE_MAX+1];
+};
+
+static size_t node_size(uint8_t type) {
+    switch (type) {
+        case NODE4:
+            return sizeof(art_node4);
+        case NODE16:
+            return sizeof(art_node16);
+        case NODE48:
+            return sizeof(art_node48);
+        case NODE256:
+            return sizeof(art_node256);
+        case NODE32:
+            return sizeof(art_node32);
+        case NODE64:
+            return sizeof(art_node64);
+        default:
+            abort();
+    }
+}
+
+static void* default_alloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void default_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+static const art_allocator default_allocator = {
+    default_alloc, default_free, NULL
+};
+
+/**
+ * An insert has no way to back out of the changes it made
+ * before an allocation fails, so running out of memory past
+ * art_tree_init_ex ends the process, rather than leaving a
+ * broken tree or writing through NULL.
+ */
+static void out_of_memory(void) {
+    abort();
+}
+
+static inline void* tree_alloc(art_tree *t, size_t size) {
+    void *p = t->allocator.alloc(t->allocator.ctx, size);
+    if (!p) out_of_memory();
+    return p;
+}
+
+static inline void tree_free(art_tree *t, void *ptr, size_t size) {
+    t->allocator.free(t->allocator.ctx, ptr, size);
+}
+
+/**
+ * Allocates node memory. Nodes from the default allocator
+ * start on a cache line, so a lookup finds the header, the
+ * keys and the first children of a node in one line. Custom
+ * allocators are called as they are, and the nodes are
+ * released with tree_free either way.
+ */
+static inline void* tree_alloc_node(art_tree *t, size_t size) {
+    void *p;
+    if (t->allocator.alloc != default_alloc)
+        return tree_alloc(t, size);
+    if (posix_memalign(&p, ART_CACHE_LINE, size))
+        out_of_memory();
+    return p;
+}
+
+#if defined(__linux__) && !defined(ART_COMPACT_REFS)
+/**
+ * Maps a huge page aligned block, from the reserved huge
+ * pages if there are any, or else as transparent huge pages.
+ */
+static void* huge_alloc(size_t size) {
+    void *p;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+#endif
+
+    // Over-map so the block can be aligned, then trim the ends
+    p = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    unsigned char *start = (unsigned char*)p;
+    unsigned char *aligned = (unsigned char*)(((uintptr_t)start + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned > start)
+        munmap(start, aligned - start);
+    munmap(aligned + size, start + size - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+#endif
+
+#ifdef ART_COMPACT_REFS
+/**
+ * Carves a block from the reserved range of the tree.
+ */
+static void* region_carve(struct art_arena *a, size_t size, size_t align) {
+    unsigned char *p = (unsigned char*)(((uintptr_t)a->top + align - 1) & ~(uintptr_t)(align - 1));
+    if (p > a->limit || (size_t)(a->limit - p) < size) return NULL;
+    a->top = p + size;
+    return p;
+}
+#endif
+
+static art_slab* slab_alloc(art_tree *t) {
+#ifdef ART_COMPACT_REFS
+    // Aligned to their size, so their pages can be dropped
+    art_slab *s = (art_slab*)region_carve(t->arena, t->arena->slab_size,
+            t->arena->slab_size);
+#ifdef MADV_HUGEPAGE
+    if (s && (t->flags & ART_TREE_HUGEPAGE))
+        madvise(s, t->arena->slab_size, MADV_HUGEPAGE);
+#endif
+    return s;
+#else
+#ifdef __linux__
+    if (t->flags & ART_TREE_HUGEPAGE)
+        return (art_slab*)huge_alloc(t->arena->slab_size);
+#endif
+    return (art_slab*)tree_alloc(t, t->arena->slab_size);
+#endif
+}
+
+static void free_slabs(art_tree *t, art_slab *s) {
+#ifdef ART_COMPACT_REFS
+    // Released with the reservation
+    (void)t;
+    (void)s;
+#else
+    art_slab *next;
+    for (; s; s = next) {
+        next = s->next;
+#ifdef __linux__
+        if (t->flags & ART_TREE_HUGEPAGE) {
+            munmap(s, t->arena->slab_size);
+            continue;
+        }
+#endif
+        tree_free(t, s, t->arena->slab_size);
+    }
+#endif
+}
+
+static struct art_arena* arena_create(art_tree *t) {
+    // Failing here fails art_tree_init_ex instead
+    struct art_arena *a = (struct art_arena*)t->allocator.alloc(t->allocator.ctx, sizeof(struct art_arena));
+    if (!a) return NULL;
+    memset(a, 0, sizeof(struct art_arena));
+    a->slab_size = ART_SLAB_SIZE;
+#ifdef __linux__
+    if (t->flags & ART_TREE_HUGEPAGE)
+        a->slab_size = ART_HUGE_SLAB_SIZE;
+#endif
+#ifdef ART_COMPACT_REFS
+    size_t size = ART_COMPACT_RESERVE;
+    void *p = MAP_FAILED;
+    for (; size >= ART_HUGE_SLAB_SIZE; size >>= 1) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) break;
+    }
+    if (p == MAP_FAILED) {
+        tree_free(t, a, sizeof(struct art_arena));
+        return NULL;
+    }
+    a->base = (unsigned char*)p;
+    a->limit = a->base + size;
+    // Offset 0 is the NULL reference
+    a->top = a->base + ART_ALIGN;
+#endif
+    return a;
+}
+
+static void free_bigs(art_tree *t, art_big *b) {
+#ifdef ART_COMPACT_REFS
+    // Released with the reservation
+    (void)t;
+    (void)b;
+#else
+    art_big *next;
+    for (; b; b = next) {
+        next = b->next;
+        tree_free(t, b, b->size);
+    }
+#endif
+}
+
+/**
+ * Hands the cached nodes back to the allocator, unless
+ * they are part of a slab.
+ * @return The number of bytes released.
+ */
+static size_t free_cached_nodes(art_tree *t, struct art_arena *a) {
+    size_t bytes = 0;
+    if (!NODES_IN_ARENA(t)) {
+        for (int type = NODE4; type <= NODE_MAX; type++) {
+            void *p, *next;
+            for (p = a->free_nodes[type]; p; p = next) {
+                next = *(void**)p;
+                tree_free(t, p, node_size(type));
+                bytes += node_size(type);
+            }
+            a->free_nodes[type] = NULL;
+            a->cached[type] = 0;
+        }
+    }
+    return bytes;
+}
+
+static void arena_destroy(art_tree *t, struct art_arena *a) {
+    free_cached_nodes(t, a);
+    free_slabs(t, a->slabs);
+    free_slabs(t, a->spare);
+    free_bigs(t, a->big);
+#ifdef ART_COMPACT_REFS
+    munmap(a->base, a->limit - a->base);
+#endif
+    tree_free(t, a, sizeof(struct art_arena));
+}
+
+/**
+ * Forgets everything allocated from the arena, keeping
+ * the slabs around for the next allocations.
+ */
+static void arena_reset(art_tree *t, struct art_arena *a) {
+    art_slab *s, *next;
+    for (s = a->slabs; s; s = next) {
+        next = s->next;
+        s->next = a->spare;
+        a->spare = s;
+    }
+    a->slabs = NULL;
+    free_bigs(t, a->big);
+    a->big = NULL;
+#ifdef ART_COMPACT_REFS
+    // Big blocks are carved again from the freed range
+    a->spare = NULL;
+    a->big_free = NULL;
+    a->top = a->base + ART_ALIGN;
+#endif
+    a->cur = a->end = NULL;
+    memset(a->free_nodes, 0, sizeof(a->free_nodes));
+    memset(a->free_leaves, 0, sizeof(a->free_leaves));
+    memset(a->cached, 0, sizeof(a->cached));
+}
+
+/**
+ * Carves a block from the current slab, aligned to align,
+ * a power of two no smaller than ART_ALIGN.
+ */
+static void* arena_bump(art_tree *t, size_t size, size_t align) {
+    struct art_arena *a = t->arena;
+    size = (size + ART_ALIGN - 1) & ~(size_t)(ART_ALIGN - 1);
+    unsigned char *p = (unsigned char*)(((uintptr_t)a->cur + align - 1) & ~(uintptr_t)(align - 1));
+    if (p > a->end || (size_t)(a->end - p) < size) {
+        art_slab *s = a->spare;
+        if (s)
+            a->spare = s->next;
+        else if (!(s = slab_alloc(t)))
+            out_of_memory();
+        s->next = a->slabs;
+        a->slabs = s;
+        a->cur = (unsigned char*)(s + 1);
+        a->end = (unsigned char*)s + a->slab_size;
+        p = (unsigned char*)(((uintptr_t)a->cur + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    a->cur = p + size;
+    return p;
+}
+
+/**
+ * Takes a node from the free list of its type, or from
+ * a slab or the allocator when there is none.
+ */
+static void* arena_alloc_node(art_tree *t, uint8_t type) {
+    struct art_arena *a = t->arena;
+    void *p = a->free_nodes[type];
+    if (p) {
+        a->free_nodes[type] = *(void**)p;
+        a->cached[type]--;
+        a->hits[type]++;
+        return p;
+    }
+    a->misses[type]++;
+    if (NODES_IN_ARENA(t))
+        return arena_bump(t, node_size(type), ART_CACHE_LINE);
+    return tree_alloc_node(t, node_size(type));
+}
+
+static void arena_free_node(art_tree *t, art_node *n) {
+    struct art_arena *a = t->arena;
+    // The link overwrites the header, read the type first
+    uint8_t type = n->type;
+    if (!NODES_IN_ARENA(t) && a->cached[type] >= ART_NODE_CACHE_MAX) {
+        tree_free(t, n, node_size(type));
+        return;
+    }
+    *(void**)n = a->free_nodes[type];
+    a->free_nodes[type] = n;
+    a->cached[type]++;
+}
+
+static void* arena_alloc_big(art_tree *t, size_t size) {
+    struct art_arena *a = t->arena;
+#ifdef ART_COMPACT_REFS
+    size = (sizeof(art_big) + size + ART_ALIGN - 1) & ~(size_t)(ART_ALIGN - 1);
+    art_big *b, **bp;
+    for (bp = &a->big_free; (b = *bp); bp = &b->next)
+        if (b->size >= size) break;
+    if (b)
+        *bp = b->next;
+    else if ((b = (art_big*)region_carve(a, size, ART_ALIGN)))
+        b->size = size;
+    else
+        out_of_memory();
+#else
+    art_big *b = (art_big*)tree_alloc(t, sizeof(art_big) + size);
+    b->size = sizeof(art_big) + size;
+#endif
+    b->prev = NULL;
+    b->next = a->big;
+    if (a->big) a->big->prev = b;
+    a->big = b;
+    return b + 1;
+}
+
+static void arena_free_big(art_tree *t, void *p) {
+    struct art_arena *a = t->arena;
+    art_big *b = (art_big*)p - 1;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        a->big = b->next;
+    if (b->next) b->next->prev = b->prev;
+#ifdef ART_COMPACT_REFS
+    b->next = a->big_free;
+    a->big_free = b;
+#else
+    tree_free(t, b, b->size);
+#endif
+}
+
+static inline size_t leaf_class(size_t size) {
+    return (size + ART_LEAF_CLASS_SIZE - 1) / ART_LEAF_CLASS_SIZE;
+}
+
+/**
+ * Allocates leaf memory from the pool. Leaves too long
+ * for a size class come from the allocator, or from the
+ * region in region mode.
+ */
+static void* arena_alloc_leaf(art_tree *t, size_t size) {
+    struct art_arena *a = t->arena;
+    size_t c = leaf_class(size);
+    if (c <= ART_LEAF_CLASSES) {
+        void *p = a->free_leaves[c];
+        if (p) {
+            a->free_leaves[c] = *(void**)p;
+            return p;
+        }
+        return arena_bump(t, c * ART_LEAF_CLASS_SIZE, ART_ALIGN);
+    }
+    if (!(t->flags & ART_TREE_REGION))
+        return tree_alloc(t, size);
+    if (size >= ART_BIG_SIZE)
+        return arena_alloc_big(t, size);
+    return arena_bump(t, (size + 7) & ~(size_t)7, ART_ALIGN);
+}
+
+/**
+ * Returns a leaf to its size class. The space of region
+ * leaves longer than that is only given back by
+ * art_tree_clear and art_tree_destroy.
+ */
+static void arena_free_leaf(art_tree *t, art_leaf *l, size_t size) {
+    struct art_arena *a = t->arena;
+    size_t c = leaf_class(size);
+    if (c <= ART_LEAF_CLASSES) {
+        *(void**)l = a->free_leaves[c];
+        a->free_leaves[c] = l;
+    } else if (!(t->flags & ART_TREE_REGION)) {
+        tree_free(t, l, size);
+    } else if (size >= ART_BIG_SIZE) {
+        arena_free_big(t, l);
+    }
+}
+
+/**
+ * Allocates a node of the given type,
+ * initializes to zero and sets the type.
+ */
+static art_node* alloc_node(art_tree *t, uint8_t type) {
+    size_t size = node_size(type);
+    art_node* n;
+    if (NODES_CACHED(t))
+        n = (art_node*)arena_alloc_node(t, type);
+    else
+        n = (art_node*)tree_alloc_node(t, size);
+    memset(n, 0, size);
+    n->type = type;
+    t->mem.nodes[type-NODE4]++;
+    t->mem.node_bytes[type-NODE4] += size;
+    return n;
+}
+
+/**
+ * Releases a node, back to the arena or the node cache
+ * if the tree has one.
+ */
+static void free_node(art_tree *t, art_node *n) {
+    t->mem.nodes[n->type-NODE4]--;
+    t->mem.node_bytes[n->type-NODE4] -= node_size(n->type);
+    if (NODES_CACHED(t))
+        arena_free_node(t, n);
+    else
+        tree_free(t, n, node_size(n->type));
+}
+
+/**
+ * Leaf of a set tree, which has no value. Set trees keep
+ * their leaves as art_set_leaf, in buckets too, and reach
+ * the key through leaf_key and leaf_key_len.
+ */
+typedef struct {
+    uint32_t key_len;
+    unsigned char key[];
+} art_set_leaf;
+
+/**
+ * Leaf of a fixed length tree, the key length being the
+ * tree's. The leaf of a fixed length set is the key alone.
+ */
+typedef struct {
+    void *value;
+    unsigned char key[];
+} art_fixed_leaf;
+
+#define IS_SET(t) ((t)->flags & ART_TREE_SET)
+#define IS_FIXED(t) ((t)->key_len)
+
+static inline uint32_t leaf_key_len(const art_tree *t, const art_leaf *l) {
+    if (IS_FIXED(t)) return t->key_len;
+    return IS_SET(t) ? ((const art_set_leaf*)l)->key_len : l->key_len;
+}
+
+static inline unsigned char* leaf_key(const art_tree *t, const art_leaf *l) {
+    if (IS_FIXED(t))
+        return IS_SET(t) ? (unsigned char*)l : ((art_fixed_leaf*)l)->key;
+    return IS_SET(t) ? ((art_set_leaf*)l)->key : ((art_leaf*)l)->key;
+}
+
+static inline void* leaf_value(const art_tree *t, const art_leaf *l) {
+    if (IS_SET(t)) return NULL;
+    return IS_FIXED(t) ? ((const art_fixed_leaf*)l)->value : l->value;
+}
+
+static inline void leaf_set_value(const art_tree *t, art_leaf *l, void *value) {
+    if (IS_SET(t)) return;
+    if (IS_FIXED(t))
+        ((art_fixed_leaf*)l)->value = value;
+    else
+        l->value = value;
+}
+
+/**
+ * Fills in a leaf, the value only where there is one
+ */
+static inline void leaf_init(const art_tree *t, art_leaf *l, const unsigned char *key, int key_len, void *value) {
+    if (IS_FIXED(t)) {
+        leaf_set_value(t, l, value);
+        memcpy(leaf_key(t, l), key, key_len);
+    } else if (IS_SET(t)) {
+        ((art_set_leaf*)l)->key_len = key_len;
+        memcpy(((art_set_leaf*)l)->key, key, key_len);
+    } else {
+        l->value = value;
+        l->key_len = key_len;
+        memcpy(l->key, key, key_len);
+    }
+}
+
+static inline size_t leaf_size(const art_tree *t, uint32_t key_len) {
+    if (IS_FIXED(t))
+        return (IS_SET(t) ? 0 : sizeof(art_fixed_leaf)) + key_len;
+    if (IS_SET(t))
+        return sizeof(art_set_leaf) + key_len;
+    return sizeof(art_leaf) + key_len;
+}
+
+/**
+ * Releases a leaf, into the leaf pool if the tree has one.
  */
-typedef struct {
-    uint32_t partial_len;
-    uint8_t type;
-    uint8_t num_children;
-    unsigned char partial[MAX_PREFIX_LEN];
-} art_node;
+static void free_leaf(art_tree *t, art_leaf *l) {
+    uint32_t key_len = leaf_key_len(t, l);
+    size_t size = leaf_size(t, key_len);
+    t->mem.leaves--;
+    t->mem.leaf_bytes -= size;
+    t->mem.key_bytes -= key_len;
+    if (LEAVES_IN_ARENA(t))
+        arena_free_leaf(t, l, size);
+    else
+        tree_free(t, l, size);
+}
 
 /**
- * Small node with only 4 children
+ * Allocates an empty bucket with room for used bytes of
+ * leaves, rounded up to the leaf size classes.
  */
-typedef struct {
-    art_node n;
-    unsigned char keys[4];
-    art_node *children[4];
-    art_leaf *me;
-} art_node4;
+static art_bucket* alloc_bucket(art_tree *t, uint32_t used) {
+    uint32_t size = (sizeof(art_bucket) + used + 15) & ~(uint32_t)15;
+    art_bucket *b;
+    if (LEAVES_IN_ARENA(t))
+        b = (art_bucket*)arena_alloc_leaf(t, size);
+    else
+        b = (art_bucket*)tree_alloc(t, size);
+    memset(b, 0, sizeof(art_bucket));
+    b->n.type = NODEB;
+    b->n.rep = (art_leaf*)b->entries;
+    b->size = size;
+    t->mem.buckets++;
+    t->mem.bucket_bytes += size;
+    return b;
+}
+
+static void free_bucket(art_tree *t, art_bucket *b) {
+    t->mem.buckets--;
+    t->mem.bucket_bytes -= b->size;
+    if (LEAVES_IN_ARENA(t))
+        arena_free_leaf(t, (art_leaf*)b, b->size);
+    else
+        tree_free(t, b, b->size);
+}
+
+// Simple inlined if
+static inline int min(int a, int b) {
+    return (a < b) ? a : b;
+}
 
 /**
- * Node with 16 children
+ * Number of prefix bytes a node has stored, the rest
+ * is only found in its leaves.
  */
-typedef struct {
-    art_node n;
-    unsigned char keys[16];
-    art_node *children[16];
-    art_leaf *me;
-} art_node16;
+#ifdef ART_HYBRID_PREFIX
+#define PREFIX_STORED(len) (len)
+#else
+#define PREFIX_STORED(len) min(MAX_PREFIX_LEN, len)
+#endif
+
+static inline const unsigned char* node_prefix(const art_node *n) {
+#ifdef ART_HYBRID_PREFIX
+    if (n->partial_len > MAX_PREFIX_LEN) {
+        const unsigned char *p;
+        memcpy(&p, n->partial, sizeof(p));
+        return p;
+    }
+#endif
+    return n->partial;
+}
 
+#ifdef ART_HYBRID_PREFIX
 /**
- * Node with 48 children, but
- * a full 256 byte field.
+ * Allocates an out-of-line prefix, from the leaf pool
+ * if the tree has one.
  */
-typedef struct {
-    art_node n;
-    unsigned char keys[256];
-    art_node *children[48];
-    art_leaf *me;
-} art_node48;
+static unsigned char* alloc_prefix(art_tree *t, uint32_t len) {
+    t->mem.prefix_bytes += len;
+    if (LEAVES_IN_ARENA(t))
+        return (unsigned char*)arena_alloc_leaf(t, len);
+    return (unsigned char*)tree_alloc(t, len);
+}
 
 /**
- * Full node with 256 children
+ * Points a node at a prefix from alloc_prefix, or stores
+ * a short one in the node.
  */
-typedef struct {
-    art_node n;
-    art_node *children[256];
-    art_leaf *me;
-} art_node256;
-
-#ifdef __SSE2__
-#include <emmintrin.h>
-#elif defined(__ARM_NEON__)
-#include <arm_neon.h>
+static void store_prefix(art_node *n, const unsigned char *p, uint32_t len) {
+    n->partial_len = len;
+    if (len > MAX_PREFIX_LEN)
+        memcpy(n->partial, &p, sizeof(p));
+    else
+        memmove(n->partial, p, len);
+}
 #endif
 
-/* From public domain
- * https://graphics.stanford.edu/~seander/bithacks.html
- *
- * Bit twiddling:
- * contains_byte:  __builtin_ctz:  for key index:
- *    0x80000000            0x20               3
- *      0x800000            0x18               2
- *      0x808000            0x10               1
- *          0x80             0x8               0
- *           0x0             0x0       not found
+/**
+ * Releases the out-of-line prefix of a node going away.
  */
-static inline uint32_t word_has_byte(uint32_t v, unsigned char c, uint32_t num) {
-    v = (v ^ (0x01010101UL * c)) | ((~0ULL) << (num << 3));
-    return (v - 0x01010101UL) & ~v & 0x80808080UL;
+static void release_prefix(art_tree *t, art_node *n) {
+#ifdef ART_HYBRID_PREFIX
+    if (n->partial_len > MAX_PREFIX_LEN) {
+        t->mem.prefix_bytes -= n->partial_len;
+        if (LEAVES_IN_ARENA(t))
+            arena_free_leaf(t, (art_leaf*)node_prefix(n), n->partial_len);
+        else
+            tree_free(t, (void*)node_prefix(n), n->partial_len);
+        n->partial_len = 0;
+    }
+#else
+    (void)t; (void)n;
+#endif
 }
 
 /**
- * Allocates a node of the given type,
- * initializes to zero and sets the type.
+ * Sets the prefix of a node, which may be taken from
+ * its current one.
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
-    size_t size;
-    switch (type) {
-        case NODE4:
-            size = sizeof(art_node4);
-            break;
-        case NODE16:
-            size = sizeof(art_node16);
-            break;
-        case NODE48:
-            size = sizeof(art_node48);
-            break;
-        case NODE256:
-            size = sizeof(art_node256);
-            break;
-        default:
-            abort();
+static void set_prefix(art_tree *t, art_node *n, const unsigned char *p, uint32_t len) {
+#ifdef ART_HYBRID_PREFIX
+    art_node old = *n;
+    if (len > MAX_PREFIX_LEN) {
+        unsigned char *copy = alloc_prefix(t, len);
+        memcpy(copy, p, len);
+        p = copy;
     }
-    n = (art_node*)calloc(1, size);
-    n->type = type;
-    return n;
+    store_prefix(n, p, len);
+    release_prefix(t, &old);
+#else
+    (void)t;
+    n->partial_len = len;
+    memmove(n->partial, p, PREFIX_STORED(len));
+#endif
 }
 
-static art_leaf* node_get_own_leaf(const art_node* n) {
-    switch (n->type) {
-        case NODE4:
-            return ((art_node4*)n)->me;
-        case NODE16:
-            return ((art_node16*)n)->me;
-        case NODE48:
-            return ((art_node48*)n)->me;
-        case NODE256:
-            return ((art_node256*)n)->me;
-        default:
-            abort();
-    }
+#define OWN_LEAF 1
+
+static inline art_leaf* node_get_own_leaf(const art_node* n) {
+    uintptr_t r = (uintptr_t)n->rep;
+    return (r & OWN_LEAF) ? (art_leaf*)(r - OWN_LEAF) : NULL;
 }
 
-static art_leaf** node_get_own_leaf_ptr(const art_node* n) {
-    switch (n->type) {
-        case NODE4:
-            return &((art_node4*)n)->me;
-        case NODE16:
-            return &((art_node16*)n)->me;
-        case NODE48:
-            return &((art_node48*)n)->me;
-        case NODE256:
-            return &((art_node256*)n)->me;
-        default:
-            abort();
-    }
+static inline art_leaf* node_rep(const art_node* n) {
+    return (art_leaf*)((uintptr_t)n->rep & ~(uintptr_t)OWN_LEAF);
 }
 
-static void node_set_own_leaf(art_node* n, art_leaf* l) {
-    switch (n->type) {
-        case NODE4:
-            ((art_node4*)n)->me = l;
-            break;
-        case NODE16:
-            ((art_node16*)n)->me = l;
-            break;
-        case NODE48:
-            ((art_node48*)n)->me = l;
-            break;
-        case NODE256:
-            ((art_node256*)n)->me = l;
-            break;
-        default:
-            abort();
-    }
+// Clearing the own leaf leaves it the rep of the node,
+// until the caller picks another
+static inline void node_set_own_leaf(art_node* n, art_leaf* l) {
+    if (l)
+        n->rep = (art_leaf*)((uintptr_t)l | OWN_LEAF);
+    else
+        n->rep = node_rep(n);
 }
 
 /**
@@ -170,48 +1288,121 @@ static void node_set_own_leaf(art_node* n, art_leaf* l) {
  * @return 0 on success.
  */
 int art_tree_init(art_tree *t) {
+    return art_tree_init_ex(t, NULL, 0);
+}
+
+/**
+ * Initializes an ART tree with the given ART_TREE_* flags
+ * @return 0 on success.
+ */
+int art_tree_init_flags(art_tree *t, int flags) {
+    return art_tree_init_ex(t, NULL, flags);
+}
+
+/**
+ * Initializes an ART tree on top of the given allocator
+ * @return 0 on success.
+ */
+int art_tree_init_ex(art_tree *t, const art_allocator *allocator, int flags) {
+    int simd = art_simd_level();
+    if (flags & ART_TREE_HUGEPAGE)
+        flags |= ART_TREE_REGION;
+
+    // Wide nodes where the CPU can search them in one go
+    if (!(flags & ART_TREE_NARROW_NODES)) {
+        if (simd >= ART_SIMD_AVX2)
+            flags |= ART_TREE_NODE32;
+        if (simd >= ART_SIMD_AVX512)
+            flags |= ART_TREE_NODE64;
+    }
+    if (flags & ART_TREE_NODE64)
+        flags |= ART_TREE_NODE32;
+#ifdef ART_COMPACT_REFS
+    // References are offsets into the region of the tree
+    flags |= ART_TREE_REGION;
+#endif
     t->root = NULL;
     t->size = 0;
+    t->flags = flags;
+    t->key_len = 0;
+    t->arena = NULL;
+    memset(&t->mem, 0, sizeof(t->mem));
+    t->allocator = allocator ? *allocator : default_allocator;
+    if (flags & (ART_TREE_ARENA | ART_TREE_REGION | ART_TREE_LEAF_POOL |
+                ART_TREE_NODE_CACHE)) {
+        t->arena = arena_create(t);
+        if (!t->arena) return 1;
+    }
     return 0;
 }
 
+/**
+ * Initializes an ART tree whose keys all have the same length
+ * @arg t The tree
+ * @arg key_len The length of every key
+ * @arg flags Bitwise or of ART_TREE_* flags
+ * @return 0 on success.
+ */
+int art_tree_init_fixed(art_tree *t, int key_len, int flags) {
+    if (key_len <= 0) return 1;
+    int res = art_tree_init_ex(t, NULL, flags);
+    t->key_len = key_len;
+    return res;
+}
+
 // Recursively destroys the tree
-static void destroy_node(art_node *n) {
+static void destroy_node(art_tree *t, art_node *n) {
     // Break if null
     if (!n) return;
 
     // Special case leafs
     if (IS_LEAF(n)) {
-        free(LEAF_RAW(n));
+        free_leaf(t, LEAF_RAW(n));
+        return;
+    }
+
+    // Buckets hold their leaves
+    if (n->type == NODEB) {
+        free_bucket(t, (art_bucket*)n);
         return;
     }
 
     // Handle each node type
     int i;
+    art_node48 *p48;
+    art_node256 *p256;
 
     switch (n->type) {
         case NODE4:
             for (i=0;i<n->num_children;i++)
-                destroy_node(((art_node4*)n)->children[i]);
+                destroy_node(t, REF_PTR(t, ((art_node4*)n)->children[i]));
             break;
 
         case NODE16:
             for (i=0;i<n->num_children;i++)
-                destroy_node(((art_node16*)n)->children[i]);
+                destroy_node(t, REF_PTR(t, ((art_node16*)n)->children[i]));
+            break;
+
+        case NODE32:
+            for (i=0;i<n->num_children;i++)
+                destroy_node(t, REF_PTR(t, ((art_node32*)n)->children[i]));
+            break;
+
+        case NODE64:
+            for (i=0;i<n->num_children;i++)
+                destroy_node(t, REF_PTR(t, ((art_node64*)n)->children[i]));
             break;
 
         case NODE48:
-            for (i=0;i<256;i++) {
-                int idx = ((art_node48*)n)->keys[i];
-                if (!idx) continue;
-                destroy_node(((art_node48*)n)->children[idx-1]);
-            }
+            p48 = (art_node48*)n;
+            for (i = bitmap_next(p48->present, 0); i < 256; i = bitmap_next(p48->present, i+1))
+                destroy_node(t, REF_PTR(t, p48->children[p48->keys[i]-1]));
             break;
 
         case NODE256:
-            for (i=0;i<256;i++)
-                if (((art_node256*)n)->children[i])
-                    destroy_node(((art_node256*)n)->children[i]);
+            p256 = (art_node256*)n;
+            for (i = bitmap_next(p256->present, 0); i < 256; i = bitmap_next(p256->present, i+1))
+                destroy_node(t, REF_PTR(t, p256->children[i]));
             break;
 
         default:
@@ -220,10 +1411,11 @@ static void destroy_node(art_node *n) {
 
     art_leaf* l = node_get_own_leaf(n);
     if (l)
-        free(l);
+        free_leaf(t, l);
 
     // Free ourself on the way up
-    free(n);
+    release_prefix(t, n);
+    free_node(t, n);
 }
 
 /**
@@ -231,7 +1423,75 @@ static void destroy_node(art_node *n) {
  * @return 0 on success.
  */
 int art_tree_destroy(art_tree *t) {
-    destroy_node(t->root);
+    // A region goes away as a whole, without a walk
+    if (!(t->flags & ART_TREE_REGION))
+        destroy_node(t, t->root);
+    if (t->arena) {
+        arena_destroy(t, t->arena);
+        t->arena = NULL;
+    }
+    memset(&t->mem, 0, sizeof(t->mem));
+    return 0;
+}
+
+/**
+ * Reports how often node allocations were served from the
+ * free lists of the tree. Trees without a node arena or
+ * node cache report zeros.
+ * @return 0 on success.
+ */
+int art_node_cache_stats(const art_tree *t, art_cache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!t->arena) return 0;
+    for (int type = NODE4; type <= NODE_MAX; type++) {
+        stats->hits[type-NODE4] = t->arena->hits[type];
+        stats->misses[type-NODE4] = t->arena->misses[type];
+    }
+    return 0;
+}
+
+/**
+ * Reads the memory usage counters of a tree.
+ * @return 0 on success.
+ */
+int art_memory_usage(const art_tree *t, art_mem_stats *stats) {
+    *stats = t->mem;
+    return 0;
+}
+
+#define NODE_LAYOUT(type, key_field, child_field) \
+    { sizeof(type), offsetof(type, key_field), offsetof(type, child_field), ART_CACHE_LINE }
+
+/**
+ * Reports the node layouts of this build.
+ * @return The number of node types.
+ */
+int art_node_layouts(art_node_layout *layouts) {
+    static const art_node_layout all[ART_NUM_NODE_TYPES] = {
+        NODE_LAYOUT(art_node4, keys, children),
+        NODE_LAYOUT(art_node16, keys, children),
+        NODE_LAYOUT(art_node48, keys, children),
+        NODE_LAYOUT(art_node256, present, children),
+        NODE_LAYOUT(art_node32, keys, children),
+        NODE_LAYOUT(art_node64, keys, children),
+    };
+    memcpy(layouts, all, sizeof(all));
+    return ART_NUM_NODE_TYPES;
+}
+
+/**
+ * Removes every entry, keeping the memory of the tree
+ * around for reuse.
+ * @return 0 on success.
+ */
+int art_tree_clear(art_tree *t) {
+    if (t->flags & ART_TREE_REGION)
+        arena_reset(t, t->arena);
+    else
+        destroy_node(t, t->root);
+    t->root = NULL;
+    t->size = 0;
+    memset(&t->mem, 0, sizeof(t->mem));
     return 0;
 }
 
@@ -243,26 +1503,13 @@ int art_tree_destroy(art_tree *t) {
 extern inline uint64_t art_size(art_tree *t);
 #endif
 
-static art_node** find_child(art_node *n, unsigned char c) {
+static art_ref* find_child(art_node *n, unsigned char c) {
     switch (n->type) {
         case NODE4:
         {
             art_node4 *p = (art_node4*)n;
 
-#if defined(__SSE2__) && defined(FORCE_SSE2)
-            // Compare the key to all 4 stored keys
-            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                    _mm_cvtsi32_si128(*(int *)p->keys));
-
-            // Use a mask to ignore children that don't exist
-            uint32_t mask = (1UL << n->num_children) - 1;
-            uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
-
-            // If we have a match (any bit set) then we can return
-            // the pointer match using ctz to get the index.
-            if (bitfield)
-                return &p->children[__builtin_ctz(bitfield)];
-#elif defined(__ARM_NEON__) && defined(FORCE_ARM_NEON)
+#if defined(__ARM_NEON__) && defined(FORCE_ARM_NEON)
             // Compare the key to all 4 stored keys
             uint8x16_t cmp = vceqq_u8(vdupq_n_u8(c),
                     vreinterpretq_u8_u32( vsetq_lane_u32(
@@ -281,17 +1528,10 @@ static art_node** find_child(art_node *n, unsigned char c) {
 #else
                 return &p->children[__builtin_ctzll(bitfield) >> 3];
 #endif
-#elif __INT_WIDTH__ >= 4
-            uint32_t bitfield = word_has_byte(*(uint32_t*)p->keys, c, n->num_children);
-            if (bitfield)
-                return &p->children[__builtin_ctz(bitfield) >> 3];
 #else
-            for (int i=0 ; i < n->num_children; i++) {
-                // this cast works around a bug in gcc 5.1 when unrolling loops
-                // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=59124
-                if (((unsigned char*)p->keys)[i] == c)
-                    return &p->children[i];
-            }
+            int i = kernels.find4(p->keys, c, n->num_children);
+            if (i >= 0)
+                return &p->children[i];
 #endif
             break;
         }
@@ -300,20 +1540,7 @@ static art_node** find_child(art_node *n, unsigned char c) {
         {
             art_node16 *p = (art_node16*)n;
 
-#ifdef __SSE2__
-            // Compare the key to all 16 stored keys
-            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)p->keys));
-
-            // Use a mask to ignore children that don't exist
-            uint32_t mask = (1UL << n->num_children) - 1;
-            uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
-
-            // If we have a match (any bit set) then we can return
-            // the pointer match using ctz to get the index.
-            if (bitfield)
-                return &p->children[__builtin_ctz(bitfield)];
-#elif defined(__ARM_NEON__)
+#ifdef __ARM_NEON__
             // Compare the key to all 16 stored keys
             uint8x8_t cmp = vshrn_n_u16(vreinterpretq_u16_u8(
                     vceqq_u8(vdupq_n_u8(c), vld1q_u8(p->keys))), 4);
@@ -332,116 +1559,462 @@ static art_node** find_child(art_node *n, unsigned char c) {
                 return &p->children[__builtin_ctzll(bitfield) >> 2];
 #endif
 #else
-            // Compare the key to all 16 stored keys
-            for (int i = 0; i < n->num_children; i++)
-                if (p->keys[i] == c)
-                    return &p->children[i];
+            int i = kernels.find16(p->keys, c, n->num_children);
+            if (i >= 0)
+                return &p->children[i];
 #endif
             break;
         }
 
-        case NODE48:
-        {
-            art_node48 *p = (art_node48*)n;
-            int i = p->keys[c];
-            if (i)
-                return &p->children[i-1];
-            break;
-        }
+        case NODE32:
+        {
+            art_node32 *p = (art_node32*)n;
+            int i = kernels.find32(p->keys, c, n->num_children);
+            if (i >= 0)
+                return &p->children[i];
+            break;
+        }
+
+        case NODE48:
+        {
+            art_node48 *p = (art_node48*)n;
+            int i = p->keys[c];
+            if (i)
+                return &p->children[i-1];
+            break;
+        }
+
+        case NODE64:
+        {
+            art_node64 *p = (art_node64*)n;
+            int i = kernels.find64(p->keys, c, n->num_children);
+            if (i >= 0)
+                return &p->children[i];
+            break;
+        }
+
+        case NODE256:
+        {
+            art_node256 *p = (art_node256*)n;
+            if (p->children[c])
+                return &p->children[c];
+            break;
+        }
+
+        default:
+            abort();
+    }
+    return NULL;
+}
+
+/**
+ * Returns the number of prefix characters shared between
+ * the key and node.
+ */
+static int check_prefix(const art_node *n, const unsigned char *key, int key_len, int depth) {
+    int max_cmp = min(PREFIX_STORED(n->partial_len), key_len - depth);
+    return key_mismatch(node_prefix(n), key + depth, max_cmp);
+}
+
+/**
+ * Checks if a leaf matches
+ * @return 0 on success.
+ */
+static int leaf_matches(const art_tree *t, const art_leaf *n, const unsigned char *key, int key_len, int depth) {
+    (void)depth;
+    // Fail if the key lengths are different
+    if (leaf_key_len(t, n) != (uint32_t)key_len) return 1;
+
+    // Compare the keys starting at the depth
+    return key_mismatch(leaf_key(t, n), key, key_len) != key_len;
+}
+
+/**
+ * Bytes a leaf with a key of the given length takes in a
+ * bucket. Set leaves only need their key_len aligned, the
+ * leaves of a fixed length set are the bare keys.
+ */
+static inline uint32_t bucket_entry_size(const art_tree *t, uint32_t key_len) {
+    if (IS_FIXED(t))
+        return IS_SET(t) ? (key_len + 3) & ~(uint32_t)3 :
+                (sizeof(art_fixed_leaf) + key_len + 7) & ~(uint32_t)7;
+    if (IS_SET(t))
+        return (sizeof(art_set_leaf) + key_len + 3) & ~(uint32_t)3;
+    return (offsetof(art_leaf, key) + key_len + 7) & ~(uint32_t)7;
+}
+
+static inline art_leaf* bucket_first(const art_bucket *b) {
+    return (art_leaf*)b->entries;
+}
+
+static inline art_leaf* bucket_next(const art_tree *t, const art_leaf *l) {
+    return (art_leaf*)((unsigned char*)l + bucket_entry_size(t, leaf_key_len(t, l)));
+}
+
+/**
+ * Looks up a key in a bucket
+ * @return The leaf of the key, NULL if there is none.
+ */
+static art_leaf* bucket_search(const art_tree *t, const art_bucket *b, const unsigned char *key, int key_len) {
+    art_leaf *l = bucket_first(b);
+    for (int i = 0; i < b->n.num_children; i++, l = bucket_next(t, l))
+        if (!leaf_matches(t, l, key, key_len, 0))
+            return l;
+    return NULL;
+}
+
+#ifdef ART_FINGERPRINTS
+/**
+ * One byte hash of a key, length included, kept next to
+ * the leaf children of Node4 and Node16 so most searches
+ * for a missing key end without loading the leaf.
+ */
+static inline unsigned char key_fingerprint(const unsigned char *key, int key_len) {
+    const uint64_t k = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = (uint64_t)key_len * k, w;
+    int i = 0;
+    for (; i + 8 <= key_len; i += 8) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * k;
+    }
+    if (i < key_len) {
+        w = 0;
+        memcpy(&w, key + i, key_len - i);
+        h = (h ^ w) * k;
+    }
+    return (unsigned char)(h >> 56);
+}
 
-        case NODE256:
-        {
-            art_node256 *p = (art_node256*)n;
-            if (p->children[c])
-                return &p->children[c];
-            break;
-        }
+static inline unsigned char child_fingerprint(const art_tree *t, const void *child) {
+    if (!IS_LEAF(child)) return 0;
+    const art_leaf *l = LEAF_RAW(child);
+    return key_fingerprint(leaf_key(t, l), leaf_key_len(t, l));
+}
 
+/**
+ * Fingerprints of a node, NULL for the types without them
+ */
+static inline unsigned char* node_fps(const art_node *n, art_ref **children) {
+    switch (n->type) {
+        case NODE4:
+            *children = ((art_node4*)n)->children;
+            return ((art_node4*)n)->fps;
+        case NODE16:
+            *children = ((art_node16*)n)->children;
+            return ((art_node16*)n)->fps;
         default:
-            abort();
+            return NULL;
     }
-    return NULL;
 }
 
-// Simple inlined if
-static inline int min(int a, int b) {
-    return (a < b) ? a : b;
+/**
+ * Checks a search key against the fingerprint of the leaf
+ * child it led to.
+ * @return 1 if the leaf cannot match the key.
+ */
+static inline int fp_rejects(const art_node *n, const art_ref *child,
+        const unsigned char *key, int key_len) {
+    art_ref *children;
+    unsigned char *fps = node_fps(n, &children);
+    return fps && fps[child - children] != key_fingerprint(key, key_len);
 }
 
 /**
- * Returns the number of prefix characters shared between
- * the key and node.
+ * Makes room for the fingerprint of a child added at idx
  */
-static int check_prefix(const art_node *n, const unsigned char *key, int key_len, int depth) {
-    int max_cmp = min(min(n->partial_len, MAX_PREFIX_LEN), key_len - depth);
-    int idx;
-    for (idx=0; idx < max_cmp; idx++) {
-        if (n->partial[idx] != key[depth+idx])
-            return idx;
-    }
-    return idx;
+static inline void fp_insert(const art_tree *t, unsigned char *fps, int num, int idx, const void *child) {
+    memmove(fps+idx+1, fps+idx, num-idx);
+    fps[idx] = child_fingerprint(t, child);
+}
+
+static inline void fp_remove(unsigned char *fps, int num, int pos) {
+    memmove(fps+pos, fps+pos+1, num - 1 - pos);
 }
 
 /**
- * Checks if a leaf matches
- * @return 0 on success.
+ * Recomputes the fingerprints of a node from its leaves,
+ * when it is built from a node without them
  */
-static int leaf_matches(const art_leaf *n, const unsigned char *key, int key_len, int depth) {
-    (void)depth;
-    // Fail if the key lengths are different
-    if (n->key_len != (uint32_t)key_len) return 1;
+static void fp_fill(const art_tree *t, unsigned char *fps, const art_ref *children, int num) {
+    for (int i = 0; i < num; i++)
+        fps[i] = child_fingerprint(t, REF_PTR(t, children[i]));
+}
 
-    // Compare the keys starting at the depth
-    return memcmp(n->key, key, key_len);
+/**
+ * Updates the fingerprint of a child that a delete below
+ * may have replaced with a leaf
+ */
+static inline void fp_refresh(const art_tree *t, art_node *n, art_ref *child) {
+    art_ref *children;
+    unsigned char *fps = node_fps(n, &children);
+    if (fps) fps[child - children] = child_fingerprint(t, REF_PTR(t, *child));
 }
 
+#define FP_INSERT(t, n, idx, child) fp_insert((t), (n)->fps, (n)->n.num_children, (idx), (child))
+#define FP_REMOVE(n, pos) fp_remove((n)->fps, (n)->n.num_children, (pos))
+#define FP_COPY(dst, src, num) memcpy((dst)->fps, (src)->fps, (num))
+#define FP_FILL(t, n, num) fp_fill((t), (n)->fps, (n)->children, (num))
+#else
+#define fp_rejects(n, child, key, key_len) 0
+#define fp_refresh(t, n, child) ((void)0)
+#define FP_INSERT(t, n, idx, child) ((void)0)
+#define FP_REMOVE(n, pos) ((void)0)
+#define FP_COPY(dst, src, num) ((void)0)
+#define FP_FILL(t, n, num) ((void)0)
+#endif
+
 /**
- * Searches for a value in the ART tree
- * @arg t The tree
- * @arg key The key
- * @arg key_len The length of the key
- * @return NULL if the item was not found, otherwise
- * the value pointer is returned.
+ * Starts loading a child as soon as a descent resolves it.
+ * A leaf also gets the line holding the end of its key, so
+ * the two misses of a long leaf overlap before leaf_matches.
  */
-void* art_search(const art_tree *t, const unsigned char *key, int key_len) {
-    art_node **child;
+static inline void prefetch_child(const art_tree *t, const art_node *n, int key_len) {
+    if (IS_LEAF(n)) {
+        const art_leaf *l = LEAF_RAW(n);
+        __builtin_prefetch(l);
+        __builtin_prefetch(leaf_key(t, l) + key_len - 1);
+    } else {
+        __builtin_prefetch(n);
+    }
+}
+
+/**
+ * Finds the child a key goes to past the prefix of a node,
+ * before the prefix is checked, and prefetches it. The
+ * child is only right once the caller has matched the
+ * prefix.
+ * @return The child reference, NULL if there is none.
+ */
+static inline art_ref* find_child_after(const art_tree *t, art_node *n, const unsigned char *key,
+        int key_len, int depth, int prefetch) {
+    int next = depth + n->partial_len;
+    if (next >= key_len) return NULL;
+    art_ref *child = find_child(n, key[next]);
+    if (prefetch && child) prefetch_child(t, REF_PTR(t, *child), key_len);
+    return child;
+}
+
+/**
+ * Finds the leaf of a key, comparing the node prefixes
+ * on the way down.
+ * @return The leaf, NULL if the key is not in the tree.
+ */
+static art_leaf* search_leaf(const art_tree *t, const unsigned char *key, int key_len) {
+    art_ref *child;
     art_node *n = t->root;
     int prefix_len, depth = 0;
+    int prefetch = t->flags & ART_TREE_PREFETCH;
     while (n) {
         // Might be a leaf
         if (IS_LEAF(n)) {
             n = (art_node*)LEAF_RAW(n);
             // Check if the expanded path matches
-            if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
-                return ((art_leaf*)n)->value;
+            if (!leaf_matches(t, (art_leaf*)n, key, key_len, depth)) {
+                return (art_leaf*)n;
             }
             return NULL;
         }
 
+        // A bucket holds the rest of the keys below
+        if (n->type == NODEB)
+            return bucket_search(t, (art_bucket*)n, key, key_len);
+
+        // Find the child past the prefix first, so it loads
+        // while the prefix is checked
+        child = find_child_after(t, n, key, key_len, depth, prefetch);
+
         // Bail if the prefix does not match
         if (n->partial_len) {
             prefix_len = check_prefix(n, key, key_len, depth);
-            if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len))
+            if (prefix_len != PREFIX_STORED(n->partial_len))
                 return NULL;
             depth += n->partial_len;
         }
 
         // Might on itself
+        if (depth == key_len)
+            return node_get_own_leaf(n);
+
+        // Recursively search, a leaf with another fingerprint
+        // cannot match
+        if (child && IS_LEAF(*child) && fp_rejects(n, child, key, key_len))
+            return NULL;
+        n = (child) ? REF_PTR(t, *child) : NULL;
+        depth++;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the leaf of a key, skipping the node prefixes on
+ * the way down and checking the whole key once at the leaf.
+ * @return The leaf, NULL if the key is not in the tree.
+ */
+static art_leaf* search_leaf_optimistic(const art_tree *t, const unsigned char *key, int key_len) {
+    art_ref *child;
+    art_node *n = t->root;
+    art_leaf *l;
+    int depth = 0;
+    int prefetch = t->flags & ART_TREE_PREFETCH;
+    while (n) {
+        if (IS_LEAF(n)) {
+            // Check the whole key once
+            l = LEAF_RAW(n);
+            if (!leaf_matches(t, l, key, key_len, depth))
+                return l;
+            return NULL;
+        }
+
+        if (n->type == NODEB)
+            return bucket_search(t, (art_bucket*)n, key, key_len);
+
+        // Skip the prefix, it is checked at the leaf
+        if (n->partial_len) {
+            depth += n->partial_len;
+            if (depth > key_len)
+                return NULL;
+        }
+
+        // Might be on itself
         if (depth == key_len) {
-            art_leaf* l = node_get_own_leaf(n);
-            return l ? l->value : NULL;
+            l = node_get_own_leaf(n);
+            if (l && !leaf_matches(t, l, key, key_len, depth))
+                return l;
+            return NULL;
         }
 
-        // Recursively search
         child = find_child(n, key[depth]);
-        n = (child) ? *child : NULL;
+        if (prefetch && child) prefetch_child(t, REF_PTR(t, *child), key_len);
+        if (child && IS_LEAF(*child) && fp_rejects(n, child, key, key_len))
+            return NULL;
+        n = (child) ? REF_PTR(t, *child) : NULL;
+        depth++;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the leaf of a key in a fixed length tree. Every
+ * key ends at a leaf, so there is no own leaf to check on
+ * the way down, nor a length to compare at the leaf.
+ * @return The leaf, NULL if the key is not in the tree.
+ */
+static art_leaf* search_leaf_fixed(const art_tree *t, const unsigned char *key, int key_len) {
+    if ((uint32_t)key_len != t->key_len) return NULL;
+
+    art_ref *child;
+    art_node *n = t->root;
+    art_leaf *l;
+    int depth = 0;
+    int prefetch = t->flags & ART_TREE_PREFETCH;
+    while (n) {
+        if (IS_LEAF(n)) {
+            l = LEAF_RAW(n);
+            return key_mismatch(leaf_key(t, l), key, key_len) == key_len ? l : NULL;
+        }
+
+        if (n->type == NODEB)
+            return bucket_search(t, (art_bucket*)n, key, key_len);
+
+        // Keys below end past the prefix
+        child = find_child_after(t, n, key, key_len, depth, prefetch);
+        if (n->partial_len) {
+            if (check_prefix(n, key, key_len, depth) != PREFIX_STORED(n->partial_len))
+                return NULL;
+            depth += n->partial_len;
+        }
+
+        if (child && IS_LEAF(*child) && fp_rejects(n, child, key, key_len))
+            return NULL;
+        n = (child) ? REF_PTR(t, *child) : NULL;
         depth++;
     }
     return NULL;
 }
 
+/**
+ * Finds the leaf of a key with the search the tree uses
+ */
+static inline art_leaf* find_leaf(const art_tree *t, const unsigned char *key, int key_len) {
+    if (t->key_len)
+        return search_leaf_fixed(t, key, key_len);
+    if (t->flags & ART_TREE_OPTIMISTIC)
+        return search_leaf_optimistic(t, key, key_len);
+    return search_leaf(t, key, key_len);
+}
+
+/**
+ * Searches for a value in the ART tree
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search(const art_tree *t, const unsigned char *key, int key_len) {
+    art_leaf *l = find_leaf(t, key, key_len);
+    return l ? leaf_value(t, l) : NULL;
+}
+
+/**
+ * Searches for a value in the ART tree, skipping the
+ * node prefixes on the way down and checking the whole
+ * key once at the leaf. Faster when most searches hit.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search_optimistic(const art_tree *t, const unsigned char *key, int key_len) {
+    art_leaf *l = search_leaf_optimistic(t, key, key_len);
+    return l ? leaf_value(t, l) : NULL;
+}
+
+/**
+ * Picks a new representative leaf for a node, its own
+ * leaf or one of the first child.
+ */
+static art_leaf* any_leaf(const art_tree *t, const art_node *n) {
+    art_leaf *l = node_get_own_leaf(n);
+    // A full Node256 wraps num_children to 0, its bitmap tells
+    if (l || (n->type != NODE256 && !n->num_children)) return l;
+
+    art_node *child;
+    int idx;
+    switch (n->type) {
+        case NODE4:
+            child = REF_PTR(t, ((const art_node4*)n)->children[0]);
+            break;
+        case NODE16:
+            child = REF_PTR(t, ((const art_node16*)n)->children[0]);
+            break;
+        case NODE32:
+            child = REF_PTR(t, ((const art_node32*)n)->children[0]);
+            break;
+        case NODE64:
+            child = REF_PTR(t, ((const art_node64*)n)->children[0]);
+            break;
+        case NODE48:
+            idx = bitmap_next(((const art_node48*)n)->present, 0);
+            idx = ((const art_node48*)n)->keys[idx] - 1;
+            child = REF_PTR(t, ((const art_node48*)n)->children[idx]);
+            break;
+        case NODE256:
+            idx = bitmap_next(((const art_node256*)n)->present, 0);
+            if (idx == 256) return NULL;
+            child = REF_PTR(t, ((const art_node256*)n)->children[idx]);
+            break;
+        case NODEB:
+            return bucket_first((const art_bucket*)n);
+        default:
+            abort();
+    }
+    return IS_LEAF(child) ? LEAF_RAW(child) : node_rep(child);
+}
+
 // Find the minimum leaf under a node
-static art_leaf* minimum(const art_node *n) {
+static art_leaf* minimum(const art_tree *t, const art_node *n) {
     // Handle base cases
     if (!n) return NULL;
     if (IS_LEAF(n)) return LEAF_RAW(n);
@@ -452,137 +2025,204 @@ static art_leaf* minimum(const art_node *n) {
     int idx;
     switch (n->type) {
         case NODE4:
-            return minimum(((const art_node4*)n)->children[0]);
+            return minimum(t, REF_PTR(t, ((const art_node4*)n)->children[0]));
         case NODE16:
-            return minimum(((const art_node16*)n)->children[0]);
+            return minimum(t, REF_PTR(t, ((const art_node16*)n)->children[0]));
+        case NODE32:
+            return minimum(t, REF_PTR(t, ((const art_node32*)n)->children[0]));
+        case NODE64:
+            return minimum(t, REF_PTR(t, ((const art_node64*)n)->children[0]));
         case NODE48:
-            idx=0;
-            while (!((const art_node48*)n)->keys[idx]) idx++;
+            idx = bitmap_next(((const art_node48*)n)->present, 0);
             idx = ((const art_node48*)n)->keys[idx] - 1;
-            return minimum(((const art_node48*)n)->children[idx]);
+            return minimum(t, REF_PTR(t, ((const art_node48*)n)->children[idx]));
         case NODE256:
-            idx=0;
-            while (!((const art_node256*)n)->children[idx]) idx++;
-            return minimum(((const art_node256*)n)->children[idx]);
+            idx = bitmap_next(((const art_node256*)n)->present, 0);
+            return minimum(t, REF_PTR(t, ((const art_node256*)n)->children[idx]));
+        case NODEB:
+            return bucket_first((const art_bucket*)n);
         default:
             abort();
     }
 }
 
 // Find the maximum leaf under a node
-static art_leaf* maximum(const art_node *n) {
+static art_leaf* maximum(const art_tree *t, const art_node *n) {
     // Handle base cases
     if (!n) return NULL;
     if (IS_LEAF(n)) return LEAF_RAW(n);
 
     int idx;
+    art_leaf *l;
     switch (n->type) {
         case NODE4:
-            return maximum(((const art_node4*)n)->children[n->num_children-1]);
+            return maximum(t, REF_PTR(t, ((const art_node4*)n)->children[n->num_children-1]));
         case NODE16:
-            return maximum(((const art_node16*)n)->children[n->num_children-1]);
+            return maximum(t, REF_PTR(t, ((const art_node16*)n)->children[n->num_children-1]));
+        case NODE32:
+            return maximum(t, REF_PTR(t, ((const art_node32*)n)->children[n->num_children-1]));
+        case NODE64:
+            return maximum(t, REF_PTR(t, ((const art_node64*)n)->children[n->num_children-1]));
         case NODE48:
-            idx=255;
-            while (!((const art_node48*)n)->keys[idx]) idx--;
+            idx = bitmap_last(((const art_node48*)n)->present);
             idx = ((const art_node48*)n)->keys[idx] - 1;
-            return maximum(((const art_node48*)n)->children[idx]);
+            return maximum(t, REF_PTR(t, ((const art_node48*)n)->children[idx]));
         case NODE256:
-            idx=255;
-            while (!((const art_node256*)n)->children[idx]) idx--;
-            return maximum(((const art_node256*)n)->children[idx]);
+            idx = bitmap_last(((const art_node256*)n)->present);
+            return maximum(t, REF_PTR(t, ((const art_node256*)n)->children[idx]));
+        case NODEB:
+            l = bucket_first((const art_bucket*)n);
+            for (idx = 1; idx < n->num_children; idx++)
+                l = bucket_next(t, l);
+            return l;
         default:
             abort();
     }
 }
 
 /**
- * Returns the minimum valued leaf
+ * Returns the minimum valued leaf, NULL for set and fixed
+ * length trees, whose leaves are no art_leaf
  */
 art_leaf* art_minimum(art_tree *t) {
-    return minimum((art_node*)t->root);
+    if (IS_SET(t) || IS_FIXED(t)) return NULL;
+    return minimum(t, (art_node*)t->root);
 }
 
 /**
- * Returns the maximum valued leaf
+ * Returns the maximum valued leaf, NULL for set and fixed
+ * length trees
  */
 art_leaf* art_maximum(art_tree *t) {
-    return maximum((art_node*)t->root);
+    if (IS_SET(t) || IS_FIXED(t)) return NULL;
+    return maximum(t, (art_node*)t->root);
 }
 
-static art_leaf* make_leaf(const unsigned char *key, int key_len, void *value) {
-    art_leaf *l = (art_leaf*)calloc(1, sizeof(art_leaf)+key_len);
-    l->value = value;
-    l->key_len = key_len;
-    memcpy(l->key, key, key_len);
+static art_leaf* make_leaf(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    size_t size = leaf_size(t, key_len);
+    art_leaf *l;
+    if (LEAVES_IN_ARENA(t))
+        l = (art_leaf*)arena_alloc_leaf(t, size);
+    else
+        l = (art_leaf*)tree_alloc(t, size);
+    leaf_init(t, l, key, key_len, value);
+    t->mem.leaves++;
+    t->mem.leaf_bytes += size;
+    t->mem.key_bytes += key_len;
     return l;
 }
 
-static int longest_common_prefix(art_leaf *l1, art_leaf *l2, int depth) {
-    int max_cmp = min(l1->key_len, l2->key_len) - depth;
-    int idx;
-    for (idx=0; idx < max_cmp; idx++) {
-        if (l1->key[depth+idx] != l2->key[depth+idx])
-            return idx;
-    }
-    return idx;
+static int longest_common_prefix(const art_tree *t, art_leaf *l1, art_leaf *l2, int depth) {
+    int max_cmp = min(leaf_key_len(t, l1), leaf_key_len(t, l2)) - depth;
+    return key_mismatch(leaf_key(t, l1) + depth, leaf_key(t, l2) + depth, max_cmp);
 }
 
 static void copy_header(art_node *dest, art_node *src) {
     dest->num_children = src->num_children;
+    // An out-of-line prefix moves along
     dest->partial_len = src->partial_len;
-    memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
+    memcpy(dest->partial, src->partial, sizeof(src->partial));
+    dest->rep = src->rep;
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_tree *t, art_node256 *n, art_ref *ref, unsigned char c, void *child) {
     (void)ref;
     n->n.num_children++;
-    n->children[c] = (art_node*)child;
+    n->children[c] = PTR_REF(t, child);
+    bitmap_set(n->present, c);
+}
+
+/**
+ * Fills a fresh Node48 from sorted keys and children
+ */
+static void node48_from_sorted(art_node48 *dst, const unsigned char *keys,
+        const art_ref *children, int num) {
+    memcpy(dst->children, children, num*sizeof(art_ref));
+    for (int i=0;i<num;i++) {
+        dst->keys[keys[i]] = i + 1;
+        bitmap_set(dst->present, keys[i]);
+    }
+    dst->slots = (1ULL << num) - 1;
+}
+
+/**
+ * Inserts a child into the sorted keys and children of
+ * a Node32 or Node64 that has room for it
+ */
+static void add_sorted(art_tree *t, unsigned char *keys, art_ref *children,
+        int num, unsigned char c, void *child) {
+    int idx = 0;
+    while (idx < num && keys[idx] < c) idx++;
+    memmove(keys+idx+1, keys+idx, num-idx);
+    memmove(children+idx+1, children+idx, (num-idx)*sizeof(art_ref));
+    keys[idx] = c;
+    children[idx] = PTR_REF(t, child);
+}
+
+static void add_child64(art_tree *t, art_node64 *n, art_ref *ref, unsigned char c, void *child) {
+    if (n->n.num_children < 64) {
+        add_sorted(t, n->keys, n->children, n->n.num_children, c, child);
+        n->n.num_children++;
+    } else {
+        art_node256 *new_node = (art_node256*)alloc_node(t, NODE256);
+        for (int i=0;i<64;i++) {
+            new_node->children[n->keys[i]] = n->children[i];
+            bitmap_set(new_node->present, n->keys[i]);
+        }
+        copy_header((art_node*)new_node, (art_node*)n);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child256(t, new_node, ref, c, child);
+    }
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_ref *ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
-        int pos = 0;
-        while (n->children[pos]) pos++;
-        n->children[pos] = (art_node*)child;
+        int pos = __builtin_ctzll(~n->slots);
+        n->slots |= 1ULL << pos;
+        n->children[pos] = PTR_REF(t, child);
         n->keys[c] = pos + 1;
+        bitmap_set(n->present, c);
         n->n.num_children++;
     } else {
-        art_node256 *new_node = (art_node256*)alloc_node(NODE256);
-        for (int i=0;i<256;i++) {
-            if (n->keys[i]) {
-                new_node->children[i] = n->children[n->keys[i] - 1];
-            }
-        }
+        art_node256 *new_node = (art_node256*)alloc_node(t, NODE256);
+        for (int i = bitmap_next(n->present, 0); i < 256; i = bitmap_next(n->present, i+1))
+            new_node->children[i] = n->children[n->keys[i] - 1];
+        memcpy(new_node->present, n->present, sizeof(n->present));
+        copy_header((art_node*)new_node, (art_node*)n);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child256(t, new_node, ref, c, child);
+    }
+}
+
+static void add_child32(art_tree *t, art_node32 *n, art_ref *ref, unsigned char c, void *child) {
+    if (n->n.num_children < 32) {
+        add_sorted(t, n->keys, n->children, n->n.num_children, c, child);
+        n->n.num_children++;
+    } else if (t->flags & ART_TREE_NODE64) {
+        art_node64 *new_node = (art_node64*)alloc_node(t, NODE64);
+        memcpy(new_node->keys, n->keys, 32);
+        memcpy(new_node->children, n->children, 32*sizeof(art_ref));
         copy_header((art_node*)new_node, (art_node*)n);
-        new_node->me = n->me;
-        *ref = (art_node*)new_node;
-        free(n);
-        add_child256(new_node, ref, c, child);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child64(t, new_node, ref, c, child);
+    } else {
+        art_node48 *new_node = (art_node48*)alloc_node(t, NODE48);
+        node48_from_sorted(new_node, n->keys, n->children, 32);
+        copy_header((art_node*)new_node, (art_node*)n);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child48(t, new_node, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_ref *ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
         int idx;
 
-#ifdef __SSE2__
-        // Compare the key to all 16 stored keys
-        __m128i cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                _mm_loadu_si128((__m128i*)n->keys));
-
-        // Use a mask to ignore children that don't exist
-        uint32_t mask = (1UL << n->n.num_children) - 1;
-        uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
-
-        // Check if less than any
-        if (bitfield) {
-            idx = __builtin_ctz(bitfield);
-            memmove(n->keys+idx+1,n->keys+idx,n->n.num_children-idx);
-            memmove(n->children+idx+1,n->children+idx,
-                    (n->n.num_children-idx)*sizeof(void*));
-        } else
-            idx = n->n.num_children;
-#elif defined(__ARM_NEON__)
+#ifdef __ARM_NEON__
         // Compare the key to all 16 stored keys
         uint8x8_t cmp = vshrn_n_u16(vreinterpretq_u16_u8(
                 vcltq_u8(vdupq_n_u8(c), vld1q_u8(n->keys))), 4);
@@ -601,65 +2241,50 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
 #endif
             memmove(n->keys+idx+1,n->keys+idx,n->n.num_children-idx);
             memmove(n->children+idx+1,n->children+idx,
-                    (n->n.num_children-idx)*sizeof(void*));
+                    (n->n.num_children-idx)*sizeof(art_ref));
         } else
             idx = n->n.num_children;
 #else
-        // Compare the key to all stored keys
-        for (idx = 0; idx < n->n.num_children; idx++) {
-            if (c < n->keys[idx]) {
-                memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
-                memmove(n->children+idx+1, n->children+idx,
-                        (n->n.num_children-idx)*sizeof(void*));
-                break;
-            }
-        }
+        idx = kernels.lower16(n->keys, c, n->n.num_children);
+        memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
+        memmove(n->children+idx+1, n->children+idx,
+                (n->n.num_children-idx)*sizeof(art_ref));
 #endif
 
         // Set the child
+        FP_INSERT(t, n, idx, child);
         n->keys[idx] = c;
-        n->children[idx] = (art_node*)child;
+        n->children[idx] = PTR_REF(t, child);
         n->n.num_children++;
 
     } else {
-        art_node48 *new_node = (art_node48*)alloc_node(NODE48);
+        if (t->flags & ART_TREE_NODE32) {
+            art_node32 *new_node = (art_node32*)alloc_node(t, NODE32);
+            memcpy(new_node->keys, n->keys, 16);
+            memcpy(new_node->children, n->children, 16*sizeof(art_ref));
+            copy_header((art_node*)new_node, (art_node*)n);
+            *ref = PTR_REF(t, new_node);
+            free_node(t, (art_node*)n);
+            add_child32(t, new_node, ref, c, child);
+            return;
+        }
+
+        art_node48 *new_node = (art_node48*)alloc_node(t, NODE48);
 
         // Copy the child pointers and populate the key map
-        memcpy(new_node->children, n->children, 16*sizeof(void*));
-        for (int i=0;i<16;i++)
-            new_node->keys[n->keys[i]] = i + 1;
+        node48_from_sorted(new_node, n->keys, n->children, 16);
         copy_header((art_node*)new_node, (art_node*)n);
-        new_node->me = n->me;
-        *ref = (art_node*)new_node;
-        free(n);
-        add_child48(new_node, ref, c, child);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child48(t, new_node, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_ref *ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
 
-#if defined(__SSE2__) && defined(FORCE_SSE2)
-        // Compare the key to all 4 stored keys
-        __m128i cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                _mm_cvtsi32_si128(*(int *)n->keys));
-
-        // Use a mask to ignore children that don't exist
-        uint32_t mask = (1 << n->n.num_children) - 1;
-        uint32_t bitfield = _mm_movemask_epi8(cmp) & mask;
-
-        // If we have a match (any bit set) then we can return
-        // the pointer match using ctz to get the index.
-        if (bitfield) {
-            idx = __builtin_ctz(bitfield);
-            // Shift to make room
-            memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
-            memmove(n->children+idx+1, n->children+idx,
-                    (n->n.num_children-idx)*sizeof(void*));
-        } else
-            idx = n->n.num_children;
-#elif defined(__ARM_NEON__) && defined(FORCE_ARM_NEON)
+#if defined(__ARM_NEON__) && defined(FORCE_ARM_NEON)
         uint8x16_t cmp = vcltq_u8(vdupq_n_u8(c),
                 vreinterpretq_u8_u32( vsetq_lane_u32(
                         *(uint32_t *)n->keys, vdupq_n_u32(0), 0)));
@@ -677,100 +2302,210 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
             // Shift to make room
             memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
             memmove(n->children+idx+1, n->children+idx,
-                    (n->n.num_children-idx)*sizeof(void*));
-        } else
-            idx = n->n.num_children;
-#elif __INT_WIDTH__ >= 4
-        uint64_t cmp = ((0x0001000100010001ULL * c) | 0x1000100010001000ULL) -
-                (((uint64_t)n->keys[0]) | ((uint64_t)n->keys[1]) << 16 |
-                 ((uint64_t)n->keys[2]) << 32 | ((uint64_t)n->keys[3]) << 48);
-        uint64_t mask = (1ULL << (n->n.num_children << 4)) - 1;
-        uint64_t bitfield = ((cmp & 0x1000100010001000ULL) ^ 0x1000100010001000ULL) & mask;
-        if (bitfield) {
-#if __LONG_WIDTH__ >= 8
-            idx = __builtin_ctzl(bitfield) >> 4;
-#else
-            idx = __builtin_ctzll(bitfield) >> 4;
-#endif
-            // Shift to make room
-            memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
-            memmove(n->children+idx+1, n->children+idx,
-                    (n->n.num_children-idx)*sizeof(void*));
+                    (n->n.num_children-idx)*sizeof(art_ref));
         } else
             idx = n->n.num_children;
 #else
-        for (idx=0; idx < n->n.num_children; idx++) {
-            if (c < n->keys[idx]) {
-                memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
-                memmove(n->children+idx+1, n->children+idx,
-                        (n->n.num_children-idx)*sizeof(void*));
-                break;
-            }
-        }
+        idx = kernels.lower4(n->keys, c, n->n.num_children);
+        memmove(n->keys+idx+1, n->keys+idx, n->n.num_children-idx);
+        memmove(n->children+idx+1, n->children+idx,
+                (n->n.num_children-idx)*sizeof(art_ref));
 #endif
 
         // Insert element
+        FP_INSERT(t, n, idx, child);
         n->keys[idx] = c;
-        n->children[idx] = (art_node*)child;
+        n->children[idx] = PTR_REF(t, child);
         n->n.num_children++;
     } else {
-        art_node16 *new_node = (art_node16*)alloc_node(NODE16);
+        art_node16 *new_node = (art_node16*)alloc_node(t, NODE16);
 
         // Copy the child pointers and the key map
-        memcpy(new_node->children, n->children, 4*sizeof(void*));
+        memcpy(new_node->children, n->children, 4*sizeof(art_ref));
         memcpy(new_node->keys, n->keys, 4*sizeof(unsigned char));
+        FP_COPY(new_node, n, 4);
         copy_header((art_node*)new_node, (art_node*)n);
-        new_node->me = n->me;
-        *ref = (art_node*)new_node;
-        free(n);
-        add_child16(new_node, ref, c, child);
+        *ref = PTR_REF(t, new_node);
+        free_node(t, (art_node*)n);
+        add_child16(t, new_node, ref, c, child);
+    }
+}
+
+static void add_child(art_tree *t, art_node *n, art_ref *ref, unsigned char c, void *child) {
+    switch (n->type) {
+        case NODE4:
+            return add_child4(t, (art_node4*)n, ref, c, child);
+        case NODE16:
+            return add_child16(t, (art_node16*)n, ref, c, child);
+        case NODE48:
+            return add_child48(t, (art_node48*)n, ref, c, child);
+        case NODE256:
+            return add_child256(t, (art_node256*)n, ref, c, child);
+        case NODE32:
+            return add_child32(t, (art_node32*)n, ref, c, child);
+        case NODE64:
+            return add_child64(t, (art_node64*)n, ref, c, child);
+        default:
+            abort();
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
-    switch (n->type) {
-        case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
-        case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
-        case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
-        case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
-        default:
-            abort();
+/**
+ * Calculates the index at which the prefixes mismatch
+ */
+static int prefix_mismatch(const art_tree *t, const art_node *n, const unsigned char *key, int key_len, int depth) {
+    int max_cmp = min(PREFIX_STORED(n->partial_len), key_len - depth);
+    int idx = key_mismatch(node_prefix(n), key + depth, max_cmp);
+    if (idx < max_cmp)
+        return idx;
+
+    // If the prefix is all stored we can avoid finding a leaf
+    if (n->partial_len > (uint32_t)PREFIX_STORED(n->partial_len)) {
+        // Prefix is longer than what we've checked, read a leaf
+        art_leaf *l = node_rep(n);
+        max_cmp = min(leaf_key_len(t, l), key_len)- depth;
+        if (idx < max_cmp)
+            idx += key_mismatch(leaf_key(t, l) + depth + idx, key + depth + idx, max_cmp - idx);
+    }
+    return idx;
+}
+
+/**
+ * Orders keys the way the tree iterates them, a key
+ * before the longer keys it is a prefix of.
+ */
+static int key_compare(const unsigned char *a, int a_len, const unsigned char *b, int b_len) {
+    int res = memcmp(a, b, min(a_len, b_len));
+    if (res) return res;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * Writes a leaf into a bucket at the given offset, moving
+ * the leaves after it. The bucket must have room for it.
+ */
+static void bucket_put(const art_tree *t, art_bucket *b, uint32_t off, const unsigned char *key, int key_len, void *value) {
+    uint32_t size = bucket_entry_size(t, key_len);
+    memmove(b->entries + off + size, b->entries + off, b->used - off);
+    leaf_init(t, (art_leaf*)(b->entries + off), key, key_len, value);
+    b->used += size;
+    b->n.num_children++;
+}
+
+/**
+ * Packs sorted leaves into a new bucket
+ */
+static art_bucket* make_bucket(art_tree *t, art_leaf **leaves, int num) {
+    uint32_t used = 0;
+    for (int i = 0; i < num; i++)
+        used += bucket_entry_size(t, leaf_key_len(t, leaves[i]));
+    art_bucket *b = alloc_bucket(t, used);
+    for (int i = 0; i < num; i++)
+        bucket_put(t, b, b->used, leaf_key(t, leaves[i]), leaf_key_len(t, leaves[i]), leaf_value(t, leaves[i]));
+    return b;
+}
+
+/**
+ * Builds a node over the leaves of a bucket at the given
+ * depth. Groups of leaves under the same byte go into
+ * smaller buckets, single ones into leaves of their own.
+ * The bucket itself is left to the caller to free.
+ */
+static art_node* split_bucket(art_tree *t, art_bucket *b, int depth) {
+    art_leaf *leaves[ART_BUCKET_MAX+1];
+    int num = b->n.num_children;
+    art_leaf *l = bucket_first(b);
+    for (int i = 0; i < num; i++, l = bucket_next(t, l))
+        leaves[i] = l;
+
+    // The first and last leaves bound the shared prefix
+    art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
+    art_ref ref = PTR_REF(t, new_node);
+    int longest_prefix = longest_common_prefix(t, leaves[0], leaves[num-1], depth);
+    if (longest_prefix)
+        set_prefix(t, &new_node->n, leaf_key(t, leaves[0])+depth, longest_prefix);
+    depth += longest_prefix;
+
+    int i = 0;
+    if (leaf_key_len(t, leaves[0]) == (uint32_t)depth) {
+        node_set_own_leaf(&new_node->n, make_leaf(t, leaf_key(t, leaves[0]), depth, leaf_value(t, leaves[0])));
+        i++;
     }
+    while (i < num) {
+        unsigned char c = leaf_key(t, leaves[i])[depth];
+        int j = i + 1;
+        while (j < num && leaf_key(t, leaves[j])[depth] == c)
+            j++;
+        void *child;
+        if (j - i == 1)
+            child = SET_LEAF(make_leaf(t, leaf_key(t, leaves[i]), leaf_key_len(t, leaves[i]), leaf_value(t, leaves[i])));
+        else
+            child = make_bucket(t, leaves + i, j - i);
+        add_child(t, REF_PTR(t, ref), &ref, c, child);
+        i = j;
+    }
+
+    art_node *n = REF_PTR(t, ref);
+    if (!node_get_own_leaf(n))
+        n->rep = any_leaf(t, n);
+    return n;
 }
 
+static void* recursive_insert(art_tree *t, art_node *n, art_ref *ref, const unsigned char *key,
+        int key_len, void *value, int depth, int *old, int replace, art_leaf **gone);
+
 /**
- * Calculates the index at which the prefixes mismatch
+ * Inserts into a bucket, moving it to a bigger block when
+ * it is out of room and splitting it into a node when it
+ * is full. The old first leaf is reported in gone when the
+ * bucket moves, so the parents can drop it as their rep.
  */
-static int prefix_mismatch(const art_node *n, const unsigned char *key, int key_len, int depth) {
-    int max_cmp = min(min(MAX_PREFIX_LEN, n->partial_len), key_len - depth);
-    int idx;
-    for (idx=0; idx < max_cmp; idx++) {
-        if (n->partial[idx] != key[depth+idx])
-            return idx;
+static void* bucket_insert(art_tree *t, art_bucket *b, art_ref *ref, const unsigned char *key,
+        int key_len, void *value, int depth, int *old, int replace, art_leaf **gone) {
+    art_leaf *l = bucket_first(b);
+    for (int i = 0; i < b->n.num_children; i++, l = bucket_next(t, l)) {
+        int res = key_compare(leaf_key(t, l), leaf_key_len(t, l), key, key_len);
+        if (!res) {
+            *old = 1;
+            void *old_val = leaf_value(t, l);
+            if (replace) leaf_set_value(t, l, value);
+            return old_val;
+        }
+        if (res > 0) break;
     }
-
-    // If the prefix is short we can avoid finding a leaf
-    if (n->partial_len > MAX_PREFIX_LEN) {
-        // Prefix is longer than what we've checked, find a leaf
-        art_leaf *l = minimum(n);
-        max_cmp = min(l->key_len, key_len)- depth;
-        for (; idx < max_cmp; idx++) {
-            if (l->key[idx+depth] != key[depth+idx])
-                return idx;
+    uint32_t off = (unsigned char*)l - b->entries;
+    uint32_t size = bucket_entry_size(t, key_len);
+
+    if (b->n.num_children < ART_BUCKET_MAX && key_len <= ART_BUCKET_KEY_MAX &&
+            key_len - depth <= ART_BUCKET_SUFFIX_MAX) {
+        if (sizeof(art_bucket) + b->used + size > b->size) {
+            art_bucket *new_bucket = alloc_bucket(t, b->used + size);
+            memcpy(new_bucket->entries, b->entries, b->used);
+            new_bucket->used = b->used;
+            new_bucket->n.num_children = b->n.num_children;
+            *ref = PTR_REF(t, new_bucket);
+            *gone = bucket_first(b);
+            free_bucket(t, b);
+            b = new_bucket;
         }
+        bucket_put(t, b, off, key, key_len, value);
+        return NULL;
     }
-    return idx;
+
+    // Full, or the key or its suffix is too long to go in a bucket
+    art_node *n = split_bucket(t, b, depth);
+    *ref = PTR_REF(t, n);
+    *gone = bucket_first(b);
+    free_bucket(t, b);
+    art_leaf *moved = NULL;
+    return recursive_insert(t, n, ref, key, key_len, value, depth, old, replace, &moved);
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, const unsigned char *key,
-        int key_len, void *value, int depth, int *old, int replace) {
+static void* recursive_insert(art_tree *t, art_node *n, art_ref *ref, const unsigned char *key,
+        int key_len, void *value, int depth, int *old, int replace, art_leaf **gone) {
     // If we are at a NULL node, inject a leaf
     if (!n) {
-        *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+        *ref = PTR_REF(t, SET_LEAF(make_leaf(t, key, key_len, value)));
         return NULL;
     }
 
@@ -779,114 +2514,139 @@ static void* recursive_insert(art_node *n, art_node **ref, const unsigned char *
         art_leaf *l = LEAF_RAW(n);
 
         // Check if we are updating an existing value
-        if (!leaf_matches(l, key, key_len, depth)) {
+        if (!leaf_matches(t, l, key, key_len, depth)) {
             *old = 1;
-            void *old_val = l->value;
-            if(replace) l->value = value;
+            void *old_val = leaf_value(t, l);
+            if (replace) leaf_set_value(t, l, value);
             return old_val;
         }
 
+        // Two leaves close to the bottom share a bucket
+        uint32_t l_len = leaf_key_len(t, l);
+        if ((t->flags & ART_TREE_LEAF_BUCKETS) &&
+                l_len <= ART_BUCKET_KEY_MAX && key_len <= ART_BUCKET_KEY_MAX &&
+                l_len - depth <= ART_BUCKET_SUFFIX_MAX && key_len - depth <= ART_BUCKET_SUFFIX_MAX) {
+            art_bucket *b = alloc_bucket(t, bucket_entry_size(t, l_len) + bucket_entry_size(t, key_len));
+            bucket_put(t, b, 0, leaf_key(t, l), l_len, leaf_value(t, l));
+            bucket_put(t, b, key_compare(leaf_key(t, l), l_len, key, key_len) < 0 ? b->used : 0,
+                    key, key_len, value);
+            *ref = PTR_REF(t, b);
+            *gone = l;
+            free_leaf(t, l);
+            return NULL;
+        }
+
         // New value, we must split the leaf into a node4
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
+        art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
 
         // Create a new leaf
-        art_leaf *l2 = make_leaf(key, key_len, value);
+        art_leaf *l2 = make_leaf(t, key, key_len, value);
+        new_node->n.rep = l;
 
         // Determine longest prefix
-        int longest_prefix = longest_common_prefix(l, l2, depth);
-        new_node->n.partial_len = longest_prefix;
-        if (longest_prefix) {
-            memcpy(new_node->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
-            // Add the leafs to the new node4
-            add_child4(new_node, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-            add_child4(new_node, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
-        } else {
-            if (l->key_len == depth) {
-                node_set_own_leaf(&new_node->n, l);
-                add_child4(new_node, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
-            } else if (l2->key_len == depth) {
-                add_child4(new_node, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-                node_set_own_leaf(&new_node->n, l2);
-            } else {
-                add_child4(new_node, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-                add_child4(new_node, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
-            }
-        }
-        *ref = (art_node*)new_node;
+        int longest_prefix = longest_common_prefix(t, l, l2, depth);
+        if (longest_prefix)
+            set_prefix(t, &new_node->n, key+depth, longest_prefix);
+
+        // Add the leafs to the new node4, a key ending at the
+        // node is its own leaf
+        depth += longest_prefix;
+        if (l_len == (uint32_t)depth)
+            node_set_own_leaf(&new_node->n, l);
+        else
+            add_child4(t, new_node, ref, leaf_key(t, l)[depth], SET_LEAF(l));
+        if (key_len == depth)
+            node_set_own_leaf(&new_node->n, l2);
+        else
+            add_child4(t, new_node, ref, key[depth], SET_LEAF(l2));
+        *ref = PTR_REF(t, new_node);
         return NULL;
     }
 
+    if (n->type == NODEB)
+        return bucket_insert(t, (art_bucket*)n, ref, key, key_len, value, depth, old, replace, gone);
+
+    // Find the child first, it loads while the prefix is compared
+    art_ref *child = find_child_after(t, n, key, key_len, depth, t->flags & ART_TREE_PREFETCH);
+
     // Check if given node has a prefix
     if (n->partial_len) {
         // Determine if the prefixes differ, since we need to split
-        int prefix_diff = prefix_mismatch(n, key, key_len, depth);
+        int prefix_diff = prefix_mismatch(t, n, key, key_len, depth);
         if ((uint32_t)prefix_diff >= n->partial_len) {
             depth += n->partial_len;
             goto recurse_search;
         }
 
         // Create a new node
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
-        *ref = (art_node*)new_node;
-        new_node->n.partial_len = prefix_diff;
-        memcpy(new_node->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
+        art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
+        *ref = PTR_REF(t, new_node);
+        set_prefix(t, &new_node->n, node_prefix(n), prefix_diff);
+        new_node->n.rep = node_rep(n);
 
         // Adjust the prefix of the old node
-        if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new_node, ref, n->partial[prefix_diff], n);
-            n->partial_len -= (prefix_diff+1);
-            memmove(n->partial, n->partial+prefix_diff+1,
-                    min(MAX_PREFIX_LEN, n->partial_len));
+        if (n->partial_len == (uint32_t)PREFIX_STORED(n->partial_len)) {
+            const unsigned char *p = node_prefix(n);
+            add_child4(t, new_node, ref, p[prefix_diff], n);
+            set_prefix(t, n, p+prefix_diff+1, n->partial_len-(prefix_diff+1));
         } else {
-            n->partial_len -= (prefix_diff+1);
-            art_leaf *l = minimum(n);
-            add_child4(new_node, ref, l->key[depth+prefix_diff], n);
-            memcpy(n->partial, l->key+depth+prefix_diff+1,
-                    min(MAX_PREFIX_LEN, n->partial_len));
+            art_leaf *l = node_rep(n);
+            add_child4(t, new_node, ref, leaf_key(t, l)[depth+prefix_diff], n);
+            set_prefix(t, n, leaf_key(t, l)+depth+prefix_diff+1, n->partial_len-(prefix_diff+1));
         }
 
         // Insert the new leaf
-        art_leaf* l = make_leaf(key, key_len, value);
+        art_leaf* l = make_leaf(t, key, key_len, value);
         if (depth+prefix_diff < key_len)
-            add_child4(new_node, ref, key[depth+prefix_diff], SET_LEAF(l));
+            add_child4(t, new_node, ref, key[depth+prefix_diff], SET_LEAF(l));
         else
             node_set_own_leaf(&new_node->n, l);
         return NULL;
     }
 
+recurse_search:;
+
+    // The key ends on this node, it is the node's own leaf
     if (depth == key_len) {
-update_node_own_leaf:;
         art_leaf* l = node_get_own_leaf(n);
         if (l) {
             *old = 1;
-            void* old_val = l->value;
-            if (replace) l->value = value;
+            void* old_val = leaf_value(t, l);
+            if (replace) leaf_set_value(t, l, value);
             return old_val;
         } else {
-            l = make_leaf(key, key_len, value);
+            l = make_leaf(t, key, key_len, value);
             node_set_own_leaf(n, l);
             return NULL;
         }
     }
 
-recurse_search:;
-
-    // Find a child to recurse to
-    art_node **child = find_child(n, key[depth]);
+    // Recurse to the child found past the prefix
     if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old, replace);
+        art_node *next = REF_PTR(t, *child);
+        void *res = recursive_insert(t, next, child, key, key_len, value, depth+1, old, replace, gone);
+        // A leaf below moved, it may have been our rep
+        if (*gone && node_rep(n) == *gone)
+            n->rep = any_leaf(t, n);
+        return res;
     }
 
     // No child, node goes within us
-    art_leaf *l = make_leaf(key, key_len, value);
-    if (depth < key_len)
-        add_child(n, ref, key[depth], SET_LEAF(l));
-    else
-        goto update_node_own_leaf;
-
+    art_leaf *l = make_leaf(t, key, key_len, value);
+    add_child(t, n, ref, key[depth], SET_LEAF(l));
     return NULL;
 }
 
+/**
+ * Checks a key against the length of a fixed length tree.
+ * A wrong length is a caller bug, debug builds stop on it.
+ * @return 1 if the key can not go into the tree.
+ */
+static inline int wrong_key_len(const art_tree *t, int key_len) {
+    assert(!t->key_len || (uint32_t)key_len == t->key_len);
+    return t->key_len && (uint32_t)key_len != t->key_len;
+}
+
 /**
  * inserts a new value into the art tree
  * @arg t the tree
@@ -894,11 +2654,16 @@ recurse_search:;
  * @arg key_len the length of the key
  * @arg value opaque value.
  * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * the old value pointer is returned. ART_KEY_REJECTED if
+ * the key has the wrong length for a fixed length tree.
  */
 void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    if (wrong_key_len(t, key_len)) return ART_KEY_REJECTED;
     int old_val = 0;
-    void *old = recursive_insert(t->root, (art_node**)&t->root, key, key_len, value, 0, &old_val, 1);
+    art_leaf *gone = NULL;
+    art_ref root = PTR_REF(t, t->root);
+    void *old = recursive_insert(t, t->root, &root, key, key_len, value, 0, &old_val, 1, &gone);
+    t->root = REF_PTR(t, root);
     if (!old_val) t->size++;
     return old;
 }
@@ -910,107 +2675,178 @@ void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value
  * @arg key_len the length of the key
  * @arg value opaque value.
  * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * the old value pointer is returned. ART_KEY_REJECTED if
+ * the key has the wrong length for a fixed length tree.
  */
 void* art_insert_no_replace(art_tree *t, const unsigned char *key, int key_len, void *value) {
+    if (wrong_key_len(t, key_len)) return ART_KEY_REJECTED;
     int old_val = 0;
-    void *old = recursive_insert(t->root, (art_node**)&t->root, key, key_len, value, 0, &old_val, 0);
+    art_leaf *gone = NULL;
+    art_ref root = PTR_REF(t, t->root);
+    void *old = recursive_insert(t, t->root, &root, key, key_len, value, 0, &old_val, 0, &gone);
+    t->root = REF_PTR(t, root);
     if (!old_val) t->size++;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
-    n->children[c] = NULL;
+static void remove_child256(art_tree *t, art_node256 *n, art_ref *ref, unsigned char c) {
+    n->children[c] = 0;
+    bitmap_clear(n->present, c);
     n->n.num_children--;
 
+    if ((t->flags & ART_TREE_NODE64) && n->n.num_children == 48) {
+        art_node64 *new_node = (art_node64*)alloc_node(t, NODE64);
+        *ref = PTR_REF(t, new_node);
+        copy_header((art_node*)new_node, (art_node*)n);
+
+        int pos = 0;
+        for (int i = bitmap_next(n->present, 0); i < 256; i = bitmap_next(n->present, i+1)) {
+            new_node->keys[pos] = i;
+            new_node->children[pos] = n->children[i];
+            pos++;
+        }
+        free_node(t, (art_node*)n);
+        return;
+    }
+
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
-    if (n->n.num_children == 37) {
-        art_node48 *new_node = (art_node48*)alloc_node(NODE48);
-        *ref = (art_node*)new_node;
+    if (!(t->flags & ART_TREE_NODE64) && n->n.num_children == 37) {
+        art_node48 *new_node = (art_node48*)alloc_node(t, NODE48);
+        *ref = PTR_REF(t, new_node);
         copy_header((art_node*)new_node, (art_node*)n);
 
         int pos = 0;
-        for (int i=0;i<256;i++) {
-            if (n->children[i]) {
-                new_node->children[pos] = n->children[i];
-                new_node->keys[i] = pos + 1;
-                pos++;
-            }
+        for (int i = bitmap_next(n->present, 0); i < 256; i = bitmap_next(n->present, i+1)) {
+            new_node->children[pos] = n->children[i];
+            new_node->keys[i] = pos + 1;
+            pos++;
         }
-        new_node->me = n->me;
-        free(n);
+        new_node->slots = (1ULL << pos) - 1;
+        memcpy(new_node->present, n->present, sizeof(n->present));
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_tree *t, art_node48 *n, art_ref *ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
-    n->children[pos-1] = NULL;
+    n->children[pos-1] = 0;
+    n->slots &= ~(1ULL << (pos-1));
+    bitmap_clear(n->present, c);
     n->n.num_children--;
 
-    if (n->n.num_children == 12) {
-        art_node16 *new_node = (art_node16*)alloc_node(NODE16);
-        *ref = (art_node*)new_node;
+    if ((t->flags & ART_TREE_NODE32) && n->n.num_children == 24) {
+        art_node32 *new_node = (art_node32*)alloc_node(t, NODE32);
+        *ref = PTR_REF(t, new_node);
         copy_header((art_node*)new_node, (art_node*)n);
 
         int child = 0;
-        for (int i=0;i<256;i++) {
-            pos = n->keys[i];
-            if (pos) {
-                new_node->keys[child] = i;
-                new_node->children[child] = n->children[pos - 1];
-                child++;
-            }
+        for (int i = bitmap_next(n->present, 0); i < 256; i = bitmap_next(n->present, i+1)) {
+            new_node->keys[child] = i;
+            new_node->children[child] = n->children[n->keys[i] - 1];
+            child++;
+        }
+        free_node(t, (art_node*)n);
+    } else if (!(t->flags & ART_TREE_NODE32) && n->n.num_children == 12) {
+        art_node16 *new_node = (art_node16*)alloc_node(t, NODE16);
+        *ref = PTR_REF(t, new_node);
+        copy_header((art_node*)new_node, (art_node*)n);
+
+        int child = 0;
+        for (int i = bitmap_next(n->present, 0); i < 256; i = bitmap_next(n->present, i+1)) {
+            new_node->keys[child] = i;
+            new_node->children[child] = n->children[n->keys[i] - 1];
+            child++;
         }
-        new_node->me = n->me;
-        free(n);
+        FP_FILL(t, new_node, 12);
+        free_node(t, (art_node*)n);
+    }
+}
+
+static void remove_child64(art_tree *t, art_node64 *n, art_ref *ref, art_ref *l) {
+    int pos = l - n->children;
+    memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
+    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(art_ref));
+    n->n.num_children--;
+
+    if (n->n.num_children == 24) {
+        art_node32 *new_node = (art_node32*)alloc_node(t, NODE32);
+        *ref = PTR_REF(t, new_node);
+        copy_header((art_node*)new_node, (art_node*)n);
+        memcpy(new_node->keys, n->keys, 24);
+        memcpy(new_node->children, n->children, 24*sizeof(art_ref));
+        free_node(t, (art_node*)n);
+    }
+}
+
+static void remove_child32(art_tree *t, art_node32 *n, art_ref *ref, art_ref *l) {
+    int pos = l - n->children;
+    memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
+    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(art_ref));
+    n->n.num_children--;
+
+    if (n->n.num_children == 12) {
+        art_node16 *new_node = (art_node16*)alloc_node(t, NODE16);
+        *ref = PTR_REF(t, new_node);
+        copy_header((art_node*)new_node, (art_node*)n);
+        memcpy(new_node->keys, n->keys, 12);
+        memcpy(new_node->children, n->children, 12*sizeof(art_ref));
+        FP_FILL(t, new_node, 12);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_tree *t, art_node16 *n, art_ref *ref, art_ref *l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
-    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
+    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(art_ref));
+    FP_REMOVE(n, pos);
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new_node = (art_node4*)alloc_node(NODE4);
-        *ref = (art_node*)new_node;
+        art_node4 *new_node = (art_node4*)alloc_node(t, NODE4);
+        *ref = PTR_REF(t, new_node);
         copy_header((art_node*)new_node, (art_node*)n);
         memcpy(new_node->keys, n->keys, 4);
-        memcpy(new_node->children, n->children, 4*sizeof(void*));
-        new_node->me = n->me;
-        free(n);
+        memcpy(new_node->children, n->children, 4*sizeof(art_ref));
+        FP_COPY(new_node, n, 4);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
-    int pos = l - n->children;
-    art_leaf* nl;
-    if (pos >= 0 && pos < n->n.num_children) {
-        memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
-        memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
-        n->n.num_children--;
-        nl = NULL;
-    } else {
-        art_leaf** lp = node_get_own_leaf_ptr(&n->n);
-        nl = *lp;
-        if ((art_node**)lp == l) {
-            if (n->n.num_children == 0) {
-                *ref = (art_node*)nl;
-                free(n);
-                return;
-            }
-        }
-        node_set_own_leaf(&n->n, NULL);
+/**
+ * Replaces a Node4 left with its own leaf only by the leaf,
+ * or with a single child only by the child.
+ */
+static void collapse_node4(art_tree *t, art_node4 *n, art_ref *ref) {
+    // A node left with its own leaf only becomes that leaf
+    art_leaf *nl = node_get_own_leaf(&n->n);
+    if (nl && n->n.num_children == 0) {
+        *ref = PTR_REF(t, SET_LEAF(nl));
+        release_prefix(t, &n->n);
+        free_node(t, (art_node*)n);
+        return;
     }
 
     // Remove nodes with only a single child
     if (nl == NULL && n->n.num_children == 1) {
-        art_node *child = n->children[0];
-        if (!IS_LEAF(child)) {
+        art_node *child = REF_PTR(t, n->children[0]);
+        // Buckets keep whole keys and move up as they are
+        if (!IS_LEAF(child) && child->type != NODEB) {
             // Concatenate the prefixes
+#ifdef ART_HYBRID_PREFIX
+            uint32_t len = n->n.partial_len + 1 + child->partial_len;
+            unsigned char buf[MAX_PREFIX_LEN];
+            unsigned char *p = (len > MAX_PREFIX_LEN) ? alloc_prefix(t, len) : buf;
+            memcpy(p, node_prefix(&n->n), n->n.partial_len);
+            p[n->n.partial_len] = n->keys[0];
+            memcpy(p + n->n.partial_len + 1, node_prefix(child), child->partial_len);
+
+            // Store the prefix in the child
+            release_prefix(t, child);
+            store_prefix(child, p, len);
+#else
             int prefix = n->n.partial_len;
             if (prefix < MAX_PREFIX_LEN) {
                 n->n.partial[prefix] = n->keys[0];
@@ -1025,45 +2861,91 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             // Store the prefix in the child
             memcpy(child->partial, n->n.partial, min(prefix, MAX_PREFIX_LEN));
             child->partial_len += n->n.partial_len + 1;
+#endif
         }
-        *ref = child;
-        free(n);
+        *ref = n->children[0];
+        release_prefix(t, &n->n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child4(art_tree *t, art_node4 *n, art_ref *ref, art_ref *l) {
+    int pos = l - n->children;
+    memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
+    memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(art_ref));
+    FP_REMOVE(n, pos);
+    n->n.num_children--;
+    collapse_node4(t, n, ref);
+}
+
+static void remove_child(art_tree *t, art_node *n, art_ref *ref, unsigned char c, art_ref *l) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(t, (art_node4*)n, ref, l);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(t, (art_node16*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(t, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(t, (art_node256*)n, ref, c);
+        case NODE32:
+            return remove_child32(t, (art_node32*)n, ref, l);
+        case NODE64:
+            return remove_child64(t, (art_node64*)n, ref, l);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned char *key, int key_len, int depth) {
+/**
+ * Deletes from a bucket, a bucket left with a single leaf
+ * is replaced by the leaf.
+ * @return The old first leaf if the key was found, which
+ * the parents drop as their rep.
+ */
+static art_leaf* bucket_delete(art_tree *t, art_bucket *b, art_ref *ref, const unsigned char *key, int key_len, void **value) {
+    art_leaf *first = bucket_first(b);
+    art_leaf *l = bucket_search(t, b, key, key_len);
+    if (!l) return NULL;
+    *value = leaf_value(t, l);
+
+    unsigned char *p = (unsigned char*)l;
+    uint32_t size = bucket_entry_size(t, leaf_key_len(t, l));
+    memmove(p, p + size, b->entries + b->used - (p + size));
+    b->used -= size;
+    b->n.num_children--;
+
+    if (b->n.num_children == 1) {
+        *ref = PTR_REF(t, SET_LEAF(make_leaf(t, leaf_key(t, first), leaf_key_len(t, first), leaf_value(t, first))));
+        free_bucket(t, b);
+    }
+    return first;
+}
+
+static art_leaf* recursive_delete(art_tree *t, art_node *n, art_ref *ref, const unsigned char *key, int key_len,
+        int depth, void **value, art_leaf **dead) {
     // Search terminated
     if (!n) return NULL;
 
     // Handle hitting a leaf node
     if (IS_LEAF(n)) {
         art_leaf *l = LEAF_RAW(n);
-        if (!leaf_matches(l, key, key_len, depth)) {
-            *ref = NULL;
+        if (!leaf_matches(t, l, key, key_len, depth)) {
+            *ref = 0;
+            *value = leaf_value(t, l);
+            *dead = l;
             return l;
         }
         return NULL;
     }
 
+    if (n->type == NODEB)
+        return bucket_delete(t, (art_bucket*)n, ref, key, key_len, value);
+
     // Bail if the prefix does not match
     if (n->partial_len) {
         int prefix_len = check_prefix(n, key, key_len, depth);
-        if (prefix_len != min(MAX_PREFIX_LEN, n->partial_len)) {
+        if (prefix_len != PREFIX_STORED(n->partial_len)) {
             return NULL;
         }
         depth = depth + n->partial_len;
@@ -1071,28 +2953,49 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned ch
 
     if (depth == key_len) {
         art_leaf* l = node_get_own_leaf(n);
-        if (l)
+        if (l) {
             node_set_own_leaf(n, NULL);
+            if (n->type == NODE4)
+                collapse_node4(t, (art_node4*)n, ref);
+
+            // The node may have been replaced, by a leaf too
+            n = REF_PTR(t, *ref);
+            if (!IS_LEAF(n) && node_rep(n) == l)
+                n->rep = any_leaf(t, n);
+            *value = leaf_value(t, l);
+            *dead = l;
+        }
         return l;
     }
 
     // Find child node
-    art_node **child = find_child(n, key[depth]);
+    art_ref *child = find_child(n, key[depth]);
     if (!child) return NULL;
 
     // If the child is leaf, delete from this node
     if (IS_LEAF(*child)) {
-        art_leaf *l = LEAF_RAW(*child);
-        if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
+        if (fp_rejects(n, child, key, key_len)) return NULL;
+        art_leaf *l = LEAF_RAW(REF_PTR(t, *child));
+        if (!leaf_matches(t, l, key, key_len, depth)) {
+            remove_child(t, n, ref, key[depth], child);
+
+            // The node may have been replaced, by a leaf too
+            n = REF_PTR(t, *ref);
+            if (!IS_LEAF(n) && node_rep(n) == l)
+                n->rep = any_leaf(t, n);
+            *value = leaf_value(t, l);
+            *dead = l;
             return l;
         }
         return NULL;
-
-    // Recurse
-    } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
     }
+
+    // Recurse, the children pick new leaves first
+    art_leaf *l = recursive_delete(t, REF_PTR(t, *child), child, key, key_len, depth+1, value, dead);
+    if (l) fp_refresh(t, n, child);
+    if (l && node_rep(n) == l)
+        n->rep = any_leaf(t, n);
+    return l;
 }
 
 /**
@@ -1104,55 +3007,90 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, const unsigned ch
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, const unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, (art_node**)&t->root, key, key_len, 0);
+    void *old = NULL;
+    art_leaf *dead = NULL;
+    art_ref root = PTR_REF(t, t->root);
+    art_leaf *l = recursive_delete(t, t->root, &root, key, key_len, 0, &old, &dead);
+    t->root = REF_PTR(t, root);
     if (l) {
         t->size--;
-        void *old = l->value;
-        free(l);
+        // Leaves deleted from a bucket go with it
+        if (dead) free_leaf(t, dead);
         return old;
     }
     return NULL;
 }
 
 // Recursively iterates over the tree
-static int recursive_iter(art_node *n, art_callback cb, void *data) {
+static int recursive_iter(const art_tree *t, art_node *n, art_callback cb, void *data) {
     // Handle base cases
     if (!n) return 0;
     if (IS_LEAF(n)) {
         art_leaf *l = LEAF_RAW(n);
-        return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        return cb(data, leaf_key(t, l), leaf_key_len(t, l), leaf_value(t, l));
     }
 
     int idx, res;
+    art_node48 *p48;
+    art_node256 *p256;
+
+    // A key ending at the node comes before the longer ones
+    art_leaf *l = node_get_own_leaf(n);
+    if (l) {
+        res = cb(data, leaf_key(t, l), leaf_key_len(t, l), leaf_value(t, l));
+        if (res) return res;
+    }
+
     switch (n->type) {
         case NODE4:
             for (int i=0; i < n->num_children; i++) {
-                res = recursive_iter(((art_node4*)n)->children[i], cb, data);
+                res = recursive_iter(t, REF_PTR(t, ((art_node4*)n)->children[i]), cb, data);
                 if (res) return res;
             }
             break;
 
         case NODE16:
             for (int i=0; i < n->num_children; i++) {
-                res = recursive_iter(((art_node16*)n)->children[i], cb, data);
+                res = recursive_iter(t, REF_PTR(t, ((art_node16*)n)->children[i]), cb, data);
                 if (res) return res;
             }
             break;
 
-        case NODE48:
-            for (int i=0; i < 256; i++) {
-                idx = ((art_node48*)n)->keys[i];
-                if (!idx) continue;
+        case NODE32:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter(t, REF_PTR(t, ((art_node32*)n)->children[i]), cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE64:
+            for (int i=0; i < n->num_children; i++) {
+                res = recursive_iter(t, REF_PTR(t, ((art_node64*)n)->children[i]), cb, data);
+                if (res) return res;
+            }
+            break;
 
-                res = recursive_iter(((art_node48*)n)->children[idx-1], cb, data);
+        case NODE48:
+            p48 = (art_node48*)n;
+            for (int i = bitmap_next(p48->present, 0); i < 256; i = bitmap_next(p48->present, i+1)) {
+                idx = p48->keys[i];
+                res = recursive_iter(t, REF_PTR(t, p48->children[idx-1]), cb, data);
                 if (res) return res;
             }
             break;
 
         case NODE256:
-            for (int i=0; i < 256; i++) {
-                if (!((art_node256*)n)->children[i]) continue;
-                res = recursive_iter(((art_node256*)n)->children[i], cb, data);
+            p256 = (art_node256*)n;
+            for (int i = bitmap_next(p256->present, 0); i < 256; i = bitmap_next(p256->present, i+1)) {
+                res = recursive_iter(t, REF_PTR(t, p256->children[i]), cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODEB:
+            l = bucket_first((art_bucket*)n);
+            for (int i = 0; i < n->num_children; i++, l = bucket_next(t, l)) {
+                res = cb(data, leaf_key(t, l), leaf_key_len(t, l), leaf_value(t, l));
                 if (res) return res;
             }
             break;
@@ -1174,19 +3112,19 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
  * @return 0 on success, or the return of the callback.
  */
 int art_iter(art_tree *t, art_callback cb, void *data) {
-    return recursive_iter(t->root, cb, data);
+    return recursive_iter(t, t->root, cb, data);
 }
 
 /**
  * Checks if a leaf prefix matches
  * @return 0 on success.
  */
-static int leaf_prefix_matches(const art_leaf *n, const unsigned char *prefix, int prefix_len) {
+static int leaf_prefix_matches(const art_tree *t, const art_leaf *n, const unsigned char *prefix, int prefix_len) {
     // Fail if the key length is too short
-    if (n->key_len < (uint32_t)prefix_len) return 1;
+    if (leaf_key_len(t, n) < (uint32_t)prefix_len) return 1;
 
     // Compare the keys
-    return memcmp(n->key, prefix, prefix_len);
+    return memcmp(leaf_key(t, n), prefix, prefix_len);
 }
 
 /**
@@ -1202,32 +3140,47 @@ static int leaf_prefix_matches(const art_leaf *n, const unsigned char *prefix, i
  * @return 0 on success, or the return of the callback.
  */
 int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_callback cb, void *data) {
-    art_node **child;
+    art_ref *child;
     art_node *n = t->root;
     int prefix_len, depth = 0;
+    int prefetch = t->flags & ART_TREE_PREFETCH;
     while (n) {
         // Might be a leaf
         if (IS_LEAF(n)) {
             n = (art_node*)LEAF_RAW(n);
             // Check if the expanded path matches
-            if (!leaf_prefix_matches((art_leaf*)n, key, key_len)) {
+            if (!leaf_prefix_matches(t, (art_leaf*)n, key, key_len)) {
                 art_leaf *l = (art_leaf*)n;
-                return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+                return cb(data, leaf_key(t, l), leaf_key_len(t, l), leaf_value(t, l));
+            }
+            return 0;
+        }
+
+        // Buckets are small, check each of their leaves
+        if (n->type == NODEB) {
+            art_leaf *l = bucket_first((art_bucket*)n);
+            for (int i = 0; i < n->num_children; i++, l = bucket_next(t, l)) {
+                if (leaf_prefix_matches(t, l, key, key_len)) continue;
+                int res = cb(data, leaf_key(t, l), leaf_key_len(t, l), leaf_value(t, l));
+                if (res) return res;
             }
             return 0;
         }
 
         // If the depth matches the prefix, we need to handle this node
         if (depth == key_len) {
-            art_leaf *l = minimum(n);
-            if (!leaf_prefix_matches(l, key, key_len))
-               return recursive_iter(n, cb, data);
+            art_leaf *l = node_rep(n);
+            if (!leaf_prefix_matches(t, l, key, key_len))
+               return recursive_iter(t, n, cb, data);
             return 0;
         }
 
+        // The child past the prefix loads while it is compared
+        child = find_child_after(t, n, key, key_len, depth, prefetch);
+
         // Bail if the prefix does not match
         if (n->partial_len) {
-            prefix_len = prefix_mismatch(n, key, key_len, depth);
+            prefix_len = prefix_mismatch(t, n, key, key_len, depth);
 
             // Guard if the mis-match is longer than the MAX_PREFIX_LEN
             if ((uint32_t)prefix_len > n->partial_len) {
@@ -1240,7 +3193,7 @@ int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_call
 
             // If we've matched the prefix, iterate on this node
             } else if (depth + prefix_len == key_len) {
-                return recursive_iter(n, cb, data);
+                return recursive_iter(t, n, cb, data);
             }
 
             // if there is a full match, go deeper
@@ -1248,9 +3201,359 @@ int art_iter_prefix(art_tree *t, const unsigned char *key, int key_len, art_call
         }
 
         // Recursively search
-        child = find_child(n, key[depth]);
-        n = (child) ? *child : NULL;
+        n = (child) ? REF_PTR(t, *child) : NULL;
         depth++;
     }
     return 0;
 }
+
+/**
+ * Initializes an ART tree used as a set of keys
+ * @return 0 on success.
+ */
+int art_set_init(art_tree *t) {
+    return art_tree_init_flags(t, ART_TREE_SET);
+}
+
+/**
+ * Adds a key to a set
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key was newly added, 0 if it was there,
+ * -1 if it has the wrong length for a fixed length tree.
+ */
+int art_set_insert(art_tree *t, const unsigned char *key, int key_len) {
+    if (wrong_key_len(t, key_len)) return -1;
+    int old_val = 0;
+    art_leaf *gone = NULL;
+    art_ref root = PTR_REF(t, t->root);
+    recursive_insert(t, t->root, &root, key, key_len, NULL, 0, &old_val, 0, &gone);
+    t->root = REF_PTR(t, root);
+    if (!old_val) t->size++;
+    return !old_val;
+}
+
+/**
+ * Checks if a set has a key
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key is in the set, otherwise 0.
+ */
+int art_set_contains(const art_tree *t, const unsigned char *key, int key_len) {
+    return find_leaf(t, key, key_len) != NULL;
+}
+
+/**
+ * Removes a key from a set
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key was removed, 0 if it was not there.
+ */
+int art_set_delete(art_tree *t, const unsigned char *key, int key_len) {
+    void *old = NULL;
+    art_leaf *dead = NULL;
+    art_ref root = PTR_REF(t, t->root);
+    art_leaf *l = recursive_delete(t, t->root, &root, key, key_len, 0, &old, &dead);
+    t->root = REF_PTR(t, root);
+    if (!l) return 0;
+    t->size--;
+    if (dead) free_leaf(t, dead);
+    return 1;
+}
+
+typedef struct {
+    art_set_callback cb;
+    void *data;
+} set_iter_data;
+
+static int set_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    set_iter_data *d = (set_iter_data*)data;
+    (void)value;
+    return d->cb(d->data, key, key_len);
+}
+
+/**
+ * Iterates through the keys of a set in order, invoking
+ * a callback for each. If the callback returns non-zero,
+ * then the iteration stops.
+ * @arg t The set to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_set_iter(art_tree *t, art_set_callback cb, void *data) {
+    set_iter_data d = { cb, data };
+    return art_iter(t, set_iter_cb, &d);
+}
+
+/**
+ * Allocates node memory for a compaction, past the free
+ * lists so the copies end up next to each other.
+ */
+static art_node* compact_alloc_node(art_tree *t, uint8_t type) {
+    if (NODES_IN_ARENA(t))
+        return (art_node*)arena_bump(t, node_size(type), ART_CACHE_LINE);
+    return (art_node*)tree_alloc_node(t, node_size(type));
+}
+
+static art_leaf* compact_alloc_leaf(art_tree *t, size_t size) {
+    if (LEAVES_IN_ARENA(t)) {
+        size_t c = leaf_class(size);
+        if (c <= ART_LEAF_CLASSES)
+            return (art_leaf*)arena_bump(t, c * ART_LEAF_CLASS_SIZE, ART_ALIGN);
+        return (art_leaf*)arena_alloc_leaf(t, size);
+    }
+    return (art_leaf*)tree_alloc(t, size);
+}
+
+static art_leaf* compact_leaf(art_tree *t, art_leaf *l) {
+    size_t size = leaf_size(t, leaf_key_len(t, l));
+    art_leaf *nl = compact_alloc_leaf(t, size);
+    memcpy(nl, l, size);
+    t->mem.leaves++;
+    t->mem.leaf_bytes += size;
+    t->mem.key_bytes += leaf_key_len(t, l);
+    return nl;
+}
+
+static art_bucket* compact_bucket(art_tree *t, art_bucket *b) {
+    art_bucket *nb = (art_bucket*)compact_alloc_leaf(t, b->size);
+    memcpy(nb, b, sizeof(art_bucket) + b->used);
+    nb->n.rep = bucket_first(nb);
+    t->mem.buckets++;
+    t->mem.bucket_bytes += b->size;
+    return nb;
+}
+
+// Recursively copies a subtree in depth-first key order,
+// leaving the original in place
+static art_node* compact_node(art_tree *t, art_node *n) {
+    if (IS_LEAF(n))
+        return (art_node*)SET_LEAF(compact_leaf(t, LEAF_RAW(n)));
+    if (n->type == NODEB)
+        return (art_node*)compact_bucket(t, (art_bucket*)n);
+
+    size_t size = node_size(n->type);
+    art_node *nn = compact_alloc_node(t, n->type);
+    memcpy(nn, n, size);
+    t->mem.nodes[n->type-NODE4]++;
+    t->mem.node_bytes[n->type-NODE4] += size;
+
+#ifdef ART_HYBRID_PREFIX
+    // The copy gets its own out-of-line prefix
+    if (nn->partial_len > MAX_PREFIX_LEN) {
+        unsigned char *p = (unsigned char*)compact_alloc_leaf(t, nn->partial_len);
+        memcpy(p, node_prefix(n), nn->partial_len);
+        store_prefix(nn, p, nn->partial_len);
+        t->mem.prefix_bytes += nn->partial_len;
+    }
+#endif
+
+    // The own leaf goes right after the node
+    art_leaf *l = node_get_own_leaf(nn);
+    if (l)
+        node_set_own_leaf(nn, compact_leaf(t, l));
+
+    int i, idx;
+    art_ref *children;
+    const uint64_t *present;
+    switch (nn->type) {
+        case NODE4:
+            children = ((art_node4*)nn)->children;
+            for (i=0; i < nn->num_children; i++)
+                children[i] = PTR_REF(t, compact_node(t, REF_PTR(t, children[i])));
+            break;
+
+        case NODE16:
+        case NODE32:
+        case NODE64:
+            if (nn->type == NODE16)
+                children = ((art_node16*)nn)->children;
+            else if (nn->type == NODE32)
+                children = ((art_node32*)nn)->children;
+            else
+                children = ((art_node64*)nn)->children;
+            for (i=0; i < nn->num_children; i++)
+                children[i] = PTR_REF(t, compact_node(t, REF_PTR(t, children[i])));
+            break;
+
+        case NODE48:
+            children = ((art_node48*)nn)->children;
+            present = ((art_node48*)nn)->present;
+            for (i = bitmap_next(present, 0); i < 256; i = bitmap_next(present, i+1)) {
+                idx = ((art_node48*)nn)->keys[i];
+                children[idx-1] = PTR_REF(t, compact_node(t, REF_PTR(t, children[idx-1])));
+            }
+            break;
+
+        case NODE256:
+            children = ((art_node256*)nn)->children;
+            present = ((art_node256*)nn)->present;
+            for (i = bitmap_next(present, 0); i < 256; i = bitmap_next(present, i+1))
+                children[i] = PTR_REF(t, compact_node(t, REF_PTR(t, children[i])));
+            break;
+
+        default:
+            abort();
+    }
+    if (!node_get_own_leaf(nn))
+        nn->rep = any_leaf(t, nn);
+    return nn;
+}
+
+/**
+ * Replaces a subtree with a compacted copy. The original
+ * is released only after the copy is complete, so its
+ * memory cannot be handed out again for the copy.
+ * @return A leaf of the copy.
+ */
+static art_leaf* compact_ref(art_tree *t, art_ref *ref) {
+    art_node *n = REF_PTR(t, *ref);
+    art_node *nn = compact_node(t, n);
+    *ref = PTR_REF(t, nn);
+    destroy_node(t, n);
+    return IS_LEAF(nn) ? LEAF_RAW(nn) : node_rep(nn);
+}
+
+/**
+ * Copies the tree into fresh memory in depth-first key
+ * order, so nodes sit next to their children and leaves.
+ * @arg t The tree
+ * @return 0 on success.
+ */
+int art_compact(art_tree *t) {
+    return art_compact_prefix(t, NULL, 0);
+}
+
+// Compacts the subtree of a prefix below a node, and
+// points the nodes on the way at a leaf of the copy
+static art_leaf* recursive_compact(art_tree *t, art_ref *ref, const unsigned char *key, int key_len, int depth) {
+    art_node *n = REF_PTR(t, *ref);
+    if (!n) return NULL;
+    if (IS_LEAF(n) || n->type == NODEB || depth == key_len)
+        return compact_ref(t, ref);
+
+    if (n->partial_len) {
+        int prefix_len = prefix_mismatch(t, n, key, key_len, depth);
+        if ((uint32_t)prefix_len > n->partial_len)
+            prefix_len = n->partial_len;
+
+        // The prefix ends inside the path of this node
+        if (depth + prefix_len == key_len)
+            return compact_ref(t, ref);
+
+        // Or no key has the prefix
+        if ((uint32_t)prefix_len < n->partial_len)
+            return NULL;
+        depth = depth + n->partial_len;
+    }
+
+    // The prefix ends right after the path of this node
+    if (depth == key_len)
+        return compact_ref(t, ref);
+
+    art_ref *child = find_child(n, key[depth]);
+    if (!child) return NULL;
+    art_leaf *l = recursive_compact(t, child, key, key_len, depth+1);
+
+    // The leaf of the node may have been in the old copy
+    if (l && !node_get_own_leaf(n))
+        n->rep = l;
+    return l;
+}
+
+/**
+ * Compacts only the entries under a key prefix, so a
+ * big tree can be compacted a part at a time.
+ * @arg t The tree
+ * @arg prefix The prefix of the keys to compact
+ * @arg prefix_len The length of the prefix
+ * @return 0 on success.
+ */
+int art_compact_prefix(art_tree *t, const unsigned char *key, int key_len) {
+    art_ref root = PTR_REF(t, t->root);
+    recursive_compact(t, &root, key, key_len, 0);
+    t->root = REF_PTR(t, root);
+    return 0;
+}
+
+/**
+ * Gives back the memory of slabs holding no live entries.
+ * Slabs in memory the tree mapped itself have their pages
+ * dropped and are kept for reuse, the others are returned
+ * to the allocator.
+ * @return The number of bytes released.
+ */
+static size_t release_slabs(art_tree *t, art_slab *s) {
+    struct art_arena *a = t->arena;
+    size_t bytes = 0;
+    art_slab *next;
+    for (; s; s = next) {
+        next = s->next;
+#ifdef ART_COMPACT_REFS
+        // The first page keeps the link to the next spare slab
+        size_t page = sysconf(_SC_PAGESIZE);
+        madvise((unsigned char*)s + page, a->slab_size - page, MADV_DONTNEED);
+        bytes += a->slab_size - page;
+        s->next = a->spare;
+        a->spare = s;
+#else
+        bytes += a->slab_size;
+        s->next = NULL;
+        free_slabs(t, s);
+#endif
+    }
+    return bytes;
+}
+
+/**
+ * Moves the entries of a tree into as few slabs as will
+ * hold them, and releases the memory left free by deletes.
+ * Trees without an arena freed their entries as they went,
+ * malloc is only asked to return its free pages.
+ * @arg t The tree
+ * @return The number of bytes released.
+ */
+size_t art_tree_shrink(art_tree *t) {
+    struct art_arena *a = t->arena;
+    if (!a) {
+#ifdef __GLIBC__
+        if (t->allocator.free == default_free)
+            malloc_trim(0);
+#endif
+        return 0;
+    }
+
+    // Copy the survivors into fresh slabs, then drop the originals
+    art_slab *old = a->slabs;
+    a->slabs = NULL;
+    a->cur = a->end = NULL;
+    if (t->root && old) {
+        art_node *n = t->root;
+        t->root = compact_node(t, n);
+        destroy_node(t, n);
+    }
+
+    // The free lists only point into the old slabs now
+    if (NODES_IN_ARENA(t)) {
+        memset(a->free_nodes, 0, sizeof(a->free_nodes));
+        memset(a->cached, 0, sizeof(a->cached));
+    }
+    memset(a->free_leaves, 0, sizeof(a->free_leaves));
+    size_t bytes = free_cached_nodes(t, a);
+
+    bytes += release_slabs(t, old);
+#ifndef ART_COMPACT_REFS
+    bytes += release_slabs(t, a->spare);
+    a->spare = NULL;
+#endif
+#ifdef __GLIBC__
+    // Slabs are too small for malloc to give them back by itself
+    if (bytes && t->allocator.free == default_free)
+        malloc_trim(0);
+#endif
+    return bytes;
+}
@@ -1,6 +1,7 @@
 #ifndef ART_H
 #define ART_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -19,6 +20,7 @@ extern "C" {
 #endif
 
 typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_len, void *value);
+typedef int(*art_set_callback)(void *data, const unsigned char *key, uint32_t key_len);
 
 /**
  * Represents a leaf. These are
@@ -31,11 +33,176 @@ typedef struct {
 } art_leaf;
 
 /**
- * Main struct, points to root.
+ * Flags accepted by art_tree_init_flags.
+ *
+ * ART_TREE_ARENA carves the inner nodes out of slabs owned
+ * by the tree and recycles them through per-type free lists,
+ * instead of going to calloc/free for every node.
+ *
+ * ART_TREE_REGION also puts the leaves in the arena, so
+ * art_tree_destroy releases the memory a slab at a time
+ * without walking the tree.
+ *
+ * ART_TREE_LEAF_POOL allocates the leaves from the arena
+ * in key length size classes, and recycles deleted leaves
+ * through a free list per class. Region trees always pool
+ * their leaves.
+ *
+ * ART_TREE_NODE_CACHE keeps a bounded number of freed
+ * nodes of each type, which node growth and shrinking
+ * draw from before going to the allocator. Arena trees
+ * always recycle their nodes.
+ *
+ * ART_TREE_HUGEPAGE is a region tree whose slabs are 2 MB
+ * huge pages, mapped from the reserved huge page pool
+ * (MAP_HUGETLB) or else as transparent huge pages
+ * (madvise MADV_HUGEPAGE). It is the same as
+ * ART_TREE_REGION on systems without either.
+ *
+ * ART_TREE_NODE32 adds a Node32 with sorted keys between
+ * Node16 and Node48, searched with one AVX2 compare.
+ * ART_TREE_NODE64 also replaces Node48 with a Node64,
+ * searched with one AVX-512 compare. Trees pick these up
+ * by themselves when the AVX2 and AVX-512 kernels are in
+ * use (see art_simd_level), unless ART_TREE_NARROW_NODES
+ * is given. Forced on other CPUs they are searched
+ * without SIMD.
+ *
+ * ART_TREE_OPTIMISTIC makes art_search skip the node
+ * prefixes and compare the whole key once at the leaf,
+ * like art_search_optimistic, for read-heavy trees.
+ *
+ * ART_TREE_PREFETCH has searches, inserts and art_iter_prefix
+ * find the child past a node's prefix before comparing the
+ * prefix, and prefetch it so the load overlaps the compare.
+ * It is experimental, with no measured gain so far.
+ *
+ * ART_TREE_LEAF_BUCKETS packs small groups of sibling leaves
+ * with short keys into leaf buckets, sorted runs of up to
+ * ART_BUCKET_MAX leaves in one block, instead of giving each
+ * one an allocation and a slot in a node. Bucket entries keep
+ * whole keys, so only keys with at most ART_BUCKET_SUFFIX_MAX
+ * bytes past the bucket go in one. A bucket is split into
+ * nodes when it overflows.
+ *
+ * ART_TREE_SET is a tree of keys only, used through the
+ * art_set_* functions. Its leaves and bucket entries hold
+ * just the key and its length, so they are no art_leaf and
+ * art_minimum and art_maximum return NULL on such a tree.
+ */
+#define ART_TREE_ARENA      0x1
+#define ART_TREE_REGION     0x2
+#define ART_TREE_LEAF_POOL  0x4
+#define ART_TREE_NODE_CACHE 0x8
+#define ART_TREE_HUGEPAGE   0x10
+#define ART_TREE_NODE32     0x20
+#define ART_TREE_NODE64     0x40
+#define ART_TREE_NARROW_NODES 0x80
+#define ART_TREE_OPTIMISTIC 0x100
+#define ART_TREE_PREFETCH   0x200
+#define ART_TREE_LEAF_BUCKETS 0x400
+#define ART_TREE_SET        0x800
+
+/**
+ * Number of inner node types, in order Node4, Node16,
+ * Node48, Node256, Node32 and Node64.
+ */
+#define ART_NUM_NODE_TYPES 6
+
+/**
+ * SIMD kernels used to search the node keys. The best
+ * level the CPU runs is picked at load time, unless the
+ * ART_SIMD environment variable names another one
+ * (scalar, sse2, avx2 or avx512).
+ */
+#define ART_SIMD_AUTO   -1
+#define ART_SIMD_SCALAR 0
+#define ART_SIMD_SSE2   1
+#define ART_SIMD_AVX2   2
+#define ART_SIMD_AVX512 3
+
+struct art_arena;
+
+/**
+ * Memory allocator used by a tree for its nodes, leaves
+ * and arena slabs. alloc returns a block of at least size
+ * bytes (its contents may be uninitialized), and free
+ * releases a block previously returned by alloc, getting
+ * back the size it was requested with.
+ *
+ * Some memory is mapped by the tree itself and never goes
+ * through the allocator: the slabs of ART_TREE_HUGEPAGE
+ * trees, which need huge page alignment, and in
+ * ART_COMPACT_REFS builds the reserved range that every
+ * node, leaf, slab and big block is carved from, as the
+ * 32-bit references are offsets into it. The arena header
+ * still comes from the allocator.
+ *
+ * alloc must not fail. Only art_tree_init_ex reports a NULL
+ * from it; an insert cannot back out half way and aborts
+ * the process instead. Memory budgets are kept by checking
+ * art_memory_usage before inserting.
+ */
+typedef struct {
+    void* (*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} art_allocator;
+
+/**
+ * Node recycling counters, per node type. A hit is a node
+ * allocation served by a previously freed node.
+ */
+typedef struct {
+    uint64_t hits[ART_NUM_NODE_TYPES];
+    uint64_t misses[ART_NUM_NODE_TYPES];
+} art_cache_stats;
+
+/**
+ * Memory held by the entries of a tree. Node and leaf
+ * bytes are the sizes requested, not counting allocator
+ * or arena overhead, and key bytes are the part of the
+ * leaf bytes taken by keys. Prefix bytes are the node
+ * prefixes kept out of line by ART_HYBRID_PREFIX builds.
+ * Buckets are the leaf buckets of ART_TREE_LEAF_BUCKETS
+ * trees, with their entries in bucket bytes.
+ */
+typedef struct {
+    uint64_t nodes[ART_NUM_NODE_TYPES];
+    uint64_t node_bytes[ART_NUM_NODE_TYPES];
+    uint64_t leaves;
+    uint64_t leaf_bytes;
+    uint64_t key_bytes;
+    uint64_t prefix_bytes;
+    uint64_t buckets;
+    uint64_t bucket_bytes;
+} art_mem_stats;
+
+/**
+ * Layout of a node type, in bytes. keys is the offset of
+ * the key index (the presence bitmap of Node256), children
+ * the offset of the first child, and align the alignment
+ * nodes get from the default allocator and the arena.
+ */
+typedef struct {
+    uint32_t size;
+    uint32_t keys;
+    uint32_t children;
+    uint32_t align;
+} art_node_layout;
+
+/**
+ * Main struct, points to root. key_len is the length of
+ * every key of a fixed length tree, 0 for other trees.
  */
 typedef struct {
     void *root;
     uint64_t size;
+    int flags;
+    uint32_t key_len;
+    struct art_arena *arena;
+    art_allocator allocator;
+    art_mem_stats mem;
 } art_tree;
 
 /**
@@ -44,6 +211,42 @@ typedef struct {
  */
 int art_tree_init(art_tree *t);
 
+/**
+ * Initializes an ART tree with the given ART_TREE_* flags
+ * @arg t The tree
+ * @arg flags Bitwise or of ART_TREE_* flags
+ * @return 0 on success.
+ */
+int art_tree_init_flags(art_tree *t, int flags);
+
+/**
+ * Initializes an ART tree that takes all its memory from
+ * the given allocator.
+ * @arg t The tree
+ * @arg allocator The allocator to use, it is copied into the tree.
+ * NULL selects malloc/free.
+ * @arg flags Bitwise or of ART_TREE_* flags
+ * @return 0 on success.
+ */
+int art_tree_init_ex(art_tree *t, const art_allocator *allocator, int flags);
+
+/**
+ * Initializes an ART tree whose keys all have the same
+ * length. No key is then a prefix of another, so no key
+ * ends at an inner node, and searches take a loop without
+ * the checks for one. Leaves keep no key length, and
+ * art_minimum and art_maximum return NULL as they are no
+ * art_leaf. Inserting a key of another length is an error:
+ * the insert returns ART_KEY_REJECTED (-1 for a set)
+ * without adding it, and debug builds assert. Searches and
+ * deletes for one find nothing.
+ * @arg t The tree
+ * @arg key_len The length of every key
+ * @arg flags Bitwise or of ART_TREE_* flags
+ * @return 0 on success.
+ */
+int art_tree_init_fixed(art_tree *t, int key_len, int flags);
+
 /**
  * DEPRECATED
  * Initializes an ART tree
@@ -57,6 +260,13 @@ int art_tree_init(art_tree *t);
  */
 int art_tree_destroy(art_tree *t);
 
+/**
+ * Removes all the entries of an ART tree. Trees with an
+ * arena keep their memory for the entries inserted next.
+ * @return 0 on success.
+ */
+int art_tree_clear(art_tree *t);
+
 /**
  * DEPRECATED
  * Initializes an ART tree
@@ -64,6 +274,32 @@ int art_tree_destroy(art_tree *t);
  */
 #define destroy_art_tree(...) art_tree_destroy(__VA_ARGS__)
 
+/**
+ * Reads the node recycling counters of a tree
+ * @arg t The tree
+ * @arg stats Filled in with the counters, zeros if the
+ * tree does not recycle nodes.
+ * @return 0 on success.
+ */
+int art_node_cache_stats(const art_tree *t, art_cache_stats *stats);
+
+/**
+ * Reads the memory usage of a tree, kept up to date by
+ * every insert and delete, so this does not walk the tree.
+ * @arg t The tree
+ * @arg stats Filled in with the usage
+ * @return 0 on success.
+ */
+int art_memory_usage(const art_tree *t, art_mem_stats *stats);
+
+/**
+ * Reports the layout of each node type of this build,
+ * indexed like the art_mem_stats counters.
+ * @arg layouts Filled in with ART_NUM_NODE_TYPES entries
+ * @return The number of entries filled in.
+ */
+int art_node_layouts(art_node_layout *layouts);
+
 /**
  * Returns the size of the ART tree.
  */
@@ -75,6 +311,12 @@ inline uint64_t art_size(art_tree *t) {
 }
 #endif
 
+/**
+ * Returned by the inserts for a key of the wrong length for
+ * a fixed length tree, which is left out of the tree.
+ */
+#define ART_KEY_REJECTED ((void*)-1)
+
 /**
  * inserts a new value into the art tree
  * @arg t the tree
@@ -82,7 +324,8 @@ inline uint64_t art_size(art_tree *t) {
  * @arg key_len the length of the key
  * @arg value opaque value.
  * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * the old value pointer is returned. ART_KEY_REJECTED if
+ * the key has the wrong length for a fixed length tree.
  */
 void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value);
 
@@ -93,7 +336,8 @@ void* art_insert(art_tree *t, const unsigned char *key, int key_len, void *value
  * @arg key_len the length of the key
  * @arg value opaque value.
  * @return null if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * the old value pointer is returned. ART_KEY_REJECTED if
+ * the key has the wrong length for a fixed length tree.
  */
 void* art_insert_no_replace(art_tree *t, const unsigned char *key, int key_len, void *value);
 
@@ -117,15 +361,29 @@ void* art_delete(art_tree *t, const unsigned char *key, int key_len);
  */
 void* art_search(const art_tree *t, const unsigned char *key, int key_len);
 
+/**
+ * Searches for a value in the ART tree without comparing
+ * the node prefixes on the way down. The key is checked
+ * once against the leaf found.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search_optimistic(const art_tree *t, const unsigned char *key, int key_len);
+
 /**
  * Returns the minimum valued leaf
- * @return The minimum leaf or NULL
+ * @return The minimum leaf or NULL, always NULL on
+ * an ART_TREE_SET or a fixed length tree
  */
 art_leaf* art_minimum(art_tree *t);
 
 /**
  * Returns the maximum valued leaf
- * @return The maximum leaf or NULL
+ * @return The maximum leaf or NULL, always NULL on
+ * an ART_TREE_SET or a fixed length tree
  */
 art_leaf* art_maximum(art_tree *t);
 
@@ -155,6 +413,102 @@ int art_iter(art_tree *t, art_callback cb, void *data);
  */
 int art_iter_prefix(art_tree *t, const unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
+/**
+ * Initializes an ART tree used as a set of keys, the same
+ * as art_tree_init_flags with ART_TREE_SET.
+ * @return 0 on success.
+ */
+int art_set_init(art_tree *t);
+
+/**
+ * Adds a key to a set
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key was newly added, 0 if it was there,
+ * -1 if it has the wrong length for a fixed length tree.
+ */
+int art_set_insert(art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Checks if a set has a key
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key is in the set, otherwise 0.
+ */
+int art_set_contains(const art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Removes a key from a set
+ * @arg t The set
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return 1 if the key was removed, 0 if it was not there.
+ */
+int art_set_delete(art_tree *t, const unsigned char *key, int key_len);
+
+/**
+ * Iterates through the keys of a set in order, invoking
+ * a callback for each. If the callback returns non-zero,
+ * then the iteration stops.
+ * @arg t The set to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_set_iter(art_tree *t, art_set_callback cb, void *data);
+
+/**
+ * Copies the tree into fresh memory in depth-first key
+ * order, so nodes sit next to their children and leaves
+ * and scans touch fewer cache lines and pages.
+ * @arg t The tree to compact
+ * @return 0 on success.
+ */
+int art_compact(art_tree *t);
+
+/**
+ * Compacts the subtree of the keys with a given prefix,
+ * to spread the compaction of a big tree over time.
+ * @arg t The tree to compact
+ * @arg prefix The prefix of the keys to compact
+ * @arg prefix_len The length of the prefix
+ * @return 0 on success.
+ */
+int art_compact_prefix(art_tree *t, const unsigned char *prefix, int prefix_len);
+
+/**
+ * Moves the entries of a tree into as few slabs as will
+ * hold them, and gives back the memory freed by deletes.
+ * The pages of emptied slabs are dropped with
+ * madvise(MADV_DONTNEED) in ART_COMPACT_REFS builds, and
+ * huge page slabs are unmapped. Other slabs go back to the
+ * allocator, and with the default one malloc_trim returns
+ * the free heap pages; there is no madvise of those slabs.
+ * Trees without an arena free their memory as entries are
+ * deleted, for them this only calls malloc_trim with the
+ * default allocator.
+ * @arg t The tree to shrink
+ * @return The number of slab bytes released, always 0 for
+ * a tree without an arena.
+ */
+size_t art_tree_shrink(art_tree *t);
+
+/**
+ * Switches all trees to the SIMD kernels of a level, for
+ * benchmarking. Trees keep the node types they were
+ * initialized with.
+ * @arg level An ART_SIMD_* level, ART_SIMD_AUTO for the best
+ * @return 0 on success, -1 if the CPU cannot run the level.
+ */
+int art_simd_force(int level);
+
+/**
+ * Returns the ART_SIMD_* level of the kernels in use.
+ */
+int art_simd_level(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,9 +1,15 @@
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #include "art.h"
 
@@ -71,69 +77,976 @@ static int test_prefix_cb(void *data, const unsigned char *k, uint32_t k_len, vo
     return 0;
 }
 
-int main() {
+static word_info *ws;
+static int total, nwords;
+
+static unsigned long long now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((unsigned long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Resident set size in KB, 0 if it cannot be read
+static long rss_kb(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Runs fn(arg) in a child process, so each run starts from a clean heap
+static void run_isolated(void (*fn)(int), int arg) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn(arg);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+static const char *flags_name(int flags) {
+    if (flags & ART_TREE_PREFETCH)
+        return (flags & ART_TREE_REGION) ? "region+pf" : "prefetch";
+    if (flags & ART_TREE_NARROW_NODES) {
+        if (flags & ART_TREE_NODE64) return "node64";
+        if (flags & ART_TREE_NODE32) return "node32";
+        return "narrow";
+    }
+    if (flags & ART_TREE_HUGEPAGE) return "hugepage";
+    if (flags & ART_TREE_REGION) return "region";
+    if ((flags & ART_TREE_ARENA) && (flags & ART_TREE_LEAF_POOL)) return "arena+pool";
+    if (flags & ART_TREE_ARENA) return "arena";
+    if (flags & ART_TREE_LEAF_POOL) return "leafpool";
+    if (flags & ART_TREE_NODE_CACHE) return "nodecache";
+    return "calloc";
+}
+
+// Allocator that counts the calls it gets
+static uint64_t alloc_calls;
+
+static void *counting_alloc(void *ctx, size_t size) {
+    (void)ctx;
+    alloc_calls++;
+    return malloc(size);
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+/**
+ * Insert throughput and RSS of a tree created with the given flags.
+ * The whole key set is inserted and the tree destroyed several times
+ * over, which is where per-node calloc/free shows up.
+ */
+static void bench_insert_flags(int flags) {
     art_tree t;
-    int len;
-    off_t off;
-    word_info *ws;
+    uintptr_t line;
+    int count, rounds = 20;
+    long rss = 0, base = rss_kb();
+
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++) {
+        art_tree_init_flags(&t, flags);
+        for (count = 0, line = 1; count < total; count++, line++)
+            art_insert(&t, ws[count].s, ws[count].len, (void *)line);
+        if (r == rounds - 1)
+            rss = rss_kb() - base;
+        art_tree_destroy(&t);
+    }
+    ts = now_usec() - ts;
+
+    printf("%-8s %12.0f inserts/sec %10ld KB rss\n", flags_name(flags),
+           (double)rounds * total * 1e6 / ts, rss);
+}
+
+static void bench_arena(void) {
+    run_isolated(bench_insert_flags, 0);
+    run_isolated(bench_insert_flags, ART_TREE_ARENA);
+}
+
+/**
+ * Time taken by art_tree_destroy on a tree holding the whole key set
+ */
+static void bench_destroy_flags(int flags) {
+    art_tree t;
+    uintptr_t line;
+    int count;
+
+    art_tree_init_flags(&t, flags);
+    for (count = 0, line = 1; count < total; count++, line++)
+        art_insert(&t, ws[count].s, ws[count].len, (void *)line);
+
+    unsigned long long ts = now_usec();
+    art_tree_destroy(&t);
+    ts = now_usec() - ts;
+
+    printf("%-8s %12llu usec destroy\n", flags_name(flags), ts);
+}
+
+static void bench_destroy(void) {
+    run_isolated(bench_destroy_flags, 0);
+    run_isolated(bench_destroy_flags, ART_TREE_ARENA);
+    run_isolated(bench_destroy_flags, ART_TREE_REGION);
+}
+
+/**
+ * Allocator calls and time for the delete + reinsert churn of
+ * the default benchmark, with and without pooled leaves.
+ */
+static void bench_churn_flags(int flags) {
+    art_allocator a = { counting_alloc, counting_free, NULL };
+    art_tree t;
+    uintptr_t line;
+    int count, rounds = 10;
+
+    alloc_calls = 0;
+    art_tree_init_ex(&t, &a, flags);
+    for (count = 0, line = 1; count < total; count++, line++)
+        art_insert(&t, ws[count].s, ws[count].len, (void *)line);
+    uint64_t warm = alloc_calls;
+
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++) {
+        for (count = 0; count < total; count++)
+            art_delete(&t, ws[count].s, ws[count].len);
+        for (count = 0; count < total; count++, line++)
+            art_insert(&t, ws[count].s, ws[count].len, (void *)line);
+    }
+    ts = now_usec() - ts;
+    art_tree_destroy(&t);
+
+    printf("%-10s %10" PRIu64 " allocs to fill %10" PRIu64 " allocs in churn %8.3f sec\n",
+           flags_name(flags), warm, alloc_calls - warm, ts * 1e-6);
+}
+
+static void bench_leafpool(void) {
+    run_isolated(bench_churn_flags, 0);
+    run_isolated(bench_churn_flags, ART_TREE_LEAF_POOL);
+    run_isolated(bench_churn_flags, ART_TREE_ARENA | ART_TREE_LEAF_POOL);
+}
+
+/**
+ * Swings the child count of many nodes across all the grow and
+ * shrink boundaries, and reports the node cache hit rate.
+ */
+static void bench_nodecache_flags(int flags) {
+    art_tree t;
+    unsigned char key[3];
+    int nodes = 1000, rounds = 50;
+
+    art_tree_init_flags(&t, flags);
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++) {
+        for (int n = 0; n < nodes; n++) {
+            key[0] = n >> 8;
+            key[1] = n & 0xff;
+            for (int i = 0; i < 60; i++) {
+                key[2] = i;
+                art_insert(&t, key, 3, NULL);
+            }
+            for (int i = 59; i >= 2; i--) {
+                key[2] = i;
+                art_delete(&t, key, 3);
+            }
+        }
+    }
+    ts = now_usec() - ts;
+
+    art_cache_stats stats;
+    uint64_t hits = 0, misses = 0;
+    art_node_cache_stats(&t, &stats);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++) {
+        hits += stats.hits[i];
+        misses += stats.misses[i];
+    }
+    art_tree_destroy(&t);
+
+    printf("%-10s %8.3f sec %6.2f%% node cache hits\n", flags_name(flags), ts * 1e-6,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+static void bench_nodecache(void) {
+    run_isolated(bench_nodecache_flags, 0);
+    run_isolated(bench_nodecache_flags, ART_TREE_NODE_CACHE);
+    run_isolated(bench_nodecache_flags, ART_TREE_ARENA);
+}
+
+// Scaled up uuid key set, each uuid repeated with a counter suffix
+static word_info *big_keys;
+static long big_total;
+
+static void make_uuid_keys(long n) {
+    int nuuid = total - nwords;
     unsigned char *str;
+    char buf[64];
+
+    big_keys = (word_info *)malloc(sizeof(word_info) * n + n * 48);
+    str = (unsigned char *)(big_keys + n);
+    for (long i = 0; i < n; i++) {
+        word_info *u = &ws[nwords + i % nuuid];
+        int len = snprintf(buf, sizeof buf, "%s-%lx", u->s, i / nuuid) + 1;
+        big_keys[i].s = str;
+        big_keys[i].len = len;
+        memcpy(str, buf, len);
+        str += len;
+    }
+    big_total = n;
+}
+
+/**
+ * Lookup latency on the scaled up uuid key set, with the lookups
+ * scattered over the whole tree so the TLB reach matters.
+ */
+static void bench_hugepage_flags(int flags) {
+    art_tree t;
+    uintptr_t sum = 0;
+
+    art_tree_init_flags(&t, flags);
+    unsigned long long ts = now_usec();
+    for (long i = 0; i < big_total; i++)
+        art_insert(&t, big_keys[i].s, big_keys[i].len, (void *)(uintptr_t)(i + 1));
+    unsigned long long insert_ts = now_usec() - ts;
+
+    ts = now_usec();
+    for (long i = 0; i < big_total; i++) {
+        long k = (long)((uint64_t)i * 2147483647ULL % big_total);
+        sum += (uintptr_t)art_search(&t, big_keys[k].s, big_keys[k].len);
+    }
+    ts = now_usec() - ts;
+    val_sum += sum;
+
+    printf("%-10s %8.3f sec insert %8.1f ns/lookup %10ld KB rss\n", flags_name(flags),
+           insert_ts * 1e-6, ts * 1000.0 / big_total, rss_kb());
+    art_tree_destroy(&t);
+}
+
+static void bench_hugepage(long n) {
+    make_uuid_keys(n);
+    printf("%ld scaled uuid keys\n", big_total);
+    run_isolated(bench_hugepage_flags, 0);
+    run_isolated(bench_hugepage_flags, ART_TREE_REGION);
+    run_isolated(bench_hugepage_flags, ART_TREE_HUGEPAGE);
+}
+
+/**
+ * Insert time and scattered lookup latency on the scaled up
+ * uuid set, keeping the best of several lookup rounds.
+ */
+static void bench_prefetch_flags(int flags) {
+    art_tree t;
+    uintptr_t sum = 0;
+    unsigned long long best = ~0ULL;
+
+    art_tree_init_flags(&t, flags);
+    unsigned long long ts = now_usec();
+    for (long i = 0; i < big_total; i++)
+        art_insert(&t, big_keys[i].s, big_keys[i].len, (void *)(uintptr_t)(i + 1));
+    unsigned long long insert_ts = now_usec() - ts;
+
+    for (int r = 0; r < 5; r++) {
+        ts = now_usec();
+        for (long i = 0; i < big_total; i++) {
+            long k = (long)((uint64_t)i * 2147483647ULL % big_total);
+            sum += (uintptr_t)art_search(&t, big_keys[k].s, big_keys[k].len);
+        }
+        ts = now_usec() - ts;
+        if (ts < best) best = ts;
+    }
+    val_sum += sum;
+
+    printf("%-10s %8.3f sec insert %8.1f ns/lookup\n", flags_name(flags),
+           insert_ts * 1e-6, best * 1000.0 / big_total);
+    art_tree_destroy(&t);
+}
+
+/**
+ * The scaled up uuid set with and without prefetching
+ * the children on the way down.
+ */
+static void bench_prefetch(long n) {
+    make_uuid_keys(n);
+    printf("%ld scaled uuid keys\n", big_total);
+    run_isolated(bench_prefetch_flags, 0);
+    run_isolated(bench_prefetch_flags, ART_TREE_PREFETCH);
+    run_isolated(bench_prefetch_flags, ART_TREE_REGION);
+    run_isolated(bench_prefetch_flags, ART_TREE_REGION | ART_TREE_PREFETCH);
+}
+
+static int count_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)k;
+    (void)k_len;
+    *(uintptr_t *)data += (uintptr_t)val;
+    return 0;
+}
+
+static unsigned long long time_scans(art_tree *t, int rounds) {
+    uintptr_t sum = 0;
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++)
+        art_iter(t, count_cb, &sum);
+    val_sum += sum;
+    return now_usec() - ts;
+}
+
+/**
+ * Full scans of a tree built in random order with delete churn,
+ * so siblings are scattered, before and after art_compact.
+ */
+static void bench_compact_flags(int flags) {
+    art_tree t;
+    int rounds = 20;
+
+    art_tree_init_flags(&t, flags);
+    for (int r = 0; r < 4; r++) {
+        for (long i = 0; i < total; i++) {
+            long k = (long)((uint64_t)(i + r) * 2147483647ULL % total);
+            art_insert(&t, ws[k].s, ws[k].len, (void *)(uintptr_t)(k + 1));
+        }
+        if (r == 3) break;
+        for (long i = r; i < total; i += 2)
+            art_delete(&t, ws[i].s, ws[i].len);
+    }
+
+    unsigned long long before = time_scans(&t, rounds);
+    unsigned long long ts = now_usec();
+    art_compact(&t);
+    ts = now_usec() - ts;
+    unsigned long long after = time_scans(&t, rounds);
+    art_tree_destroy(&t);
+
+    printf("%-10s %8.2f ms/scan before %8.2f ms/scan after %8.2f ms compact\n",
+           flags_name(flags), before * 1e-3 / rounds, after * 1e-3 / rounds, ts * 1e-3);
+}
+
+static void bench_compact(void) {
+    run_isolated(bench_compact_flags, 0);
+    run_isolated(bench_compact_flags, ART_TREE_ARENA | ART_TREE_LEAF_POOL);
+}
+
+/**
+ * RSS after deleting most of the keys, before and after art_tree_shrink
+ */
+static void bench_shrink_flags(int flags) {
+    art_tree t;
     uintptr_t line;
-    art_leaf *l;
-    char buf[512];
-    struct timeval tv;
-    unsigned long long ts;
+    int count;
+    long base = rss_kb();
 
-    size_t total_len = 0;
+    art_tree_init_flags(&t, flags);
+    for (count = 0, line = 1; count < total; count++, line++)
+        art_insert(&t, ws[count].s, ws[count].len, (void *)line);
+    long full = rss_kb() - base;
+    for (count = 0; count < total; count++)
+        if (count % 10)
+            art_delete(&t, ws[count].s, ws[count].len);
+    long purged = rss_kb() - base;
 
-    FILE *f1 = fopen("tests/words.txt", "r");
-    FILE *f2 = fopen("tests/uuid.txt", "r");
-    int count = 0;
-    while (fgets(buf, sizeof buf, f1)) {
-        len = strlen(buf);
-        total_len += len;
-        count++;
+    unsigned long long ts = now_usec();
+    size_t released = art_tree_shrink(&t);
+    ts = now_usec() - ts;
+
+    printf("%-10s %8ld KB full %8ld KB purged %8ld KB shrunk %8zu KB released %6.2f ms\n",
+           flags_name(flags), full, purged, rss_kb() - base, released / 1024, ts * 1e-3);
+    art_tree_destroy(&t);
+}
+
+static void bench_shrink(void) {
+    run_isolated(bench_shrink_flags, 0);
+    run_isolated(bench_shrink_flags, ART_TREE_ARENA | ART_TREE_LEAF_POOL);
+    run_isolated(bench_shrink_flags, ART_TREE_REGION);
+    run_isolated(bench_shrink_flags, ART_TREE_HUGEPAGE);
+}
+
+/**
+ * Insert and delete churn on Node48s holding 17 to 48 children,
+ * never crossing the grow or shrink boundaries.
+ */
+static void bench_node48(void) {
+    art_tree t;
+    unsigned char key[3];
+    int nodes = 4096, rounds = 200;
+    uint64_t *present = calloc(nodes, sizeof(uint64_t));
+    uint32_t x = 1;
+
+    art_tree_init(&t);
+    for (int n = 0; n < nodes; n++) {
+        key[0] = n >> 8;
+        key[1] = n & 0xff;
+        for (int i = 0; i < 17 + n % 32; i++) {
+            key[2] = i;
+            art_insert(&t, key, 3, NULL);
+            present[n] |= 1ULL << i;
+        }
     }
-    while (fgets(buf, sizeof buf, f2)) {
-        len = strlen(buf);
-        total_len += len;
-        count++;
+
+    // Each node swaps a random child for a missing one
+    unsigned long long ts = now_usec();
+    long ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (int n = 0; n < nodes; n++) {
+            key[0] = n >> 8;
+            key[1] = n & 0xff;
+            x = x * 1103515245 + 12345;
+            int out = (x >> 16) & 63;
+            if (!(present[n] & (1ULL << out)))
+                continue;
+            int in = __builtin_ctzll(~present[n]);
+            key[2] = out;
+            art_delete(&t, key, 3);
+            key[2] = in;
+            art_insert(&t, key, 3, NULL);
+            present[n] ^= (1ULL << out) | (1ULL << in);
+            ops += 2;
+        }
     }
-    int total = count;
-    printf("read %d keys\n", total);
+    ts = now_usec() - ts;
 
-    ws = (word_info *)malloc(sizeof(word_info) * count + total_len);
-    str = ((unsigned char *)ws) + sizeof(word_info) * count;
+    printf("node48 churn %12.0f ops/sec\n", ops * 1e6 / ts);
+    art_tree_destroy(&t);
+    free(present);
+}
 
-    count = 0;
-    off = 0;
+static int first_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)k;
+    (void)k_len;
+    *(uintptr_t *)data += (uintptr_t)val;
+    return 1;
+}
 
-    fseek(f1, 0, SEEK_SET);
-    while (fgets(buf, sizeof buf, f1)) {
-        len = strlen(buf);
-        buf[len - 1] = '\0';
-        ws[count].s = str + off;
-        ws[count].len = len;
-        memcpy(ws[count].s, buf, len);
-        count++;
-        off += len;
+/**
+ * Ordered scans and first-key lookups under wide, sparse Node48s
+ * and Node256s.
+ */
+static void bench_sparse_nodes(int children) {
+    art_tree t;
+    unsigned char key[3];
+    int nodes = 4096, rounds = 50;
+    uintptr_t sum = 0;
+
+    art_tree_init(&t);
+    for (int n = 0; n < nodes; n++) {
+        key[0] = n >> 8;
+        key[1] = n & 0xff;
+        for (int i = 0; i < children; i++) {
+            key[2] = 255 - i * (256 / children);
+            art_insert(&t, key, 3, (void *)(uintptr_t)(i + 1));
+        }
     }
 
-    fseek(f2, 0, SEEK_SET);
-    while (fgets(buf, sizeof buf, f2)) {
-        len = strlen(buf);
-        buf[len - 1] = '\0';
-        ws[count].s = str + off;
-        ws[count].len = len;
-        memcpy(ws[count].s, buf, len);
-        count++;
-        off += len;
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++)
+        art_iter(&t, count_cb, &sum);
+    unsigned long long scan = now_usec() - ts;
+
+    ts = now_usec();
+    for (int r = 0; r < rounds; r++) {
+        for (int n = 0; n < nodes; n++) {
+            key[0] = n >> 8;
+            key[1] = n & 0xff;
+            art_iter_prefix(&t, key, 2, first_cb, &sum);
+        }
     }
+    unsigned long long first = now_usec() - ts;
+    val_sum += sum;
 
-    fclose(f1);
-    fclose(f2);
+    printf("%3d children %8.2f ms/scan %8.1f ns/first key\n", children,
+           scan * 1e-3 / rounds, first * 1e3 / rounds / nodes);
+    art_tree_destroy(&t);
+}
 
-    gettimeofday(&tv, NULL);
-    ts = ((long)tv.tv_sec) * 1000000 + tv.tv_usec;
+static void bench_sparse(void) {
+    bench_sparse_nodes(20);
+    bench_sparse_nodes(40);
+    bench_sparse_nodes(60);
+}
+
+/**
+ * Lookups on a tree with the given node types, with node fanouts
+ * spread over 2 to 100 children
+ */
+static void bench_wide_flags(int flags) {
+    art_tree t;
+    art_mem_stats m;
+    unsigned char key[3];
+    int nodes = 8192, rounds = 20;
+    uintptr_t sum = 0;
+
+    art_tree_init_flags(&t, flags);
+    for (int n = 0; n < nodes; n++) {
+        key[0] = n >> 8;
+        key[1] = n & 0xff;
+        for (int i = 0; i < 2 + n % 99; i++) {
+            key[2] = i * 13 + n;
+            art_insert(&t, key, 3, (void *)(uintptr_t)(i + 1));
+        }
+    }
+    for (int i = 0; i < total; i++)
+        art_insert(&t, ws[i].s, ws[i].len, (void *)(uintptr_t)(i + 1));
+
+    uint32_t x = 1;
+    unsigned long long ts = now_usec();
+    for (int r = 0; r < rounds; r++) {
+        for (int n = 0; n < nodes; n++) {
+            x = x * 1103515245 + 12345;
+            key[0] = n >> 8;
+            key[1] = n & 0xff;
+            key[2] = (x >> 16) % (2 + n % 99) * 13 + n;
+            sum += (uintptr_t)art_search(&t, key, 3);
+        }
+        for (int i = 0; i < total; i++)
+            sum += (uintptr_t)art_search(&t, ws[i].s, ws[i].len);
+    }
+    ts = now_usec() - ts;
+    val_sum += sum;
+
+    uint64_t bytes = 0;
+    art_memory_usage(&t, &m);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        bytes += m.node_bytes[i];
+    printf("%-8s %8.1f ns/search %8" PRIu64 " KB in nodes\n", flags_name(flags),
+           ts * 1e3 / rounds / (nodes + total), bytes / 1024);
+    art_tree_destroy(&t);
+}
+
+static void bench_wide(void) {
+    run_isolated(bench_wide_flags, ART_TREE_NARROW_NODES);
+    run_isolated(bench_wide_flags, ART_TREE_NARROW_NODES | ART_TREE_NODE32);
+    run_isolated(bench_wide_flags, ART_TREE_NARROW_NODES | ART_TREE_NODE64);
+}
+
+/**
+ * The wide node lookups with each SIMD kernel level
+ * the CPU runs
+ */
+static void bench_simd_level(int level) {
+    static const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+    if (art_simd_force(level))
+        return;
+    printf("%-7s ", names[level]);
+    bench_wide_flags(ART_TREE_NARROW_NODES | ART_TREE_NODE64);
+}
+
+static void bench_simd(void) {
+    for (int level = ART_SIMD_SCALAR; level <= ART_SIMD_AVX512; level++)
+        run_isolated(bench_simd_level, level);
+}
+
+/**
+ * Inserts and lookups of keys sharing all but their last
+ * 4 bytes, for each key length bucket, with the key
+ * comparisons on the kernels of one SIMD level
+ */
+static void bench_keylen_level(int level) {
+    static const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+    static const int lens[] = { 8, 16, 32, 64, 128, 256 };
+    int n = 100000, rounds = 10;
+    unsigned char key[256];
+
+    if (art_simd_force(level))
+        return;
+    printf("%-7s", names[level]);
+    for (int b = 0; b < 6; b++) {
+        int len = lens[b];
+        art_tree t;
+        uintptr_t sum = 0;
+
+        for (int i = 0; i < len - 4; i++)
+            key[i] = long_key1[i % sizeof(long_key1)];
+        art_tree_init(&t);
+        unsigned long long ts = now_usec();
+        for (int i = 0; i < n; i++) {
+            memcpy(key + len - 4, &i, 4);
+            art_insert(&t, key, len, (void *)(uintptr_t)(i + 1));
+        }
+        unsigned long long ti = now_usec() - ts;
+
+        ts = now_usec();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < n; i++) {
+                memcpy(key + len - 4, &i, 4);
+                sum += (uintptr_t)art_search(&t, key, len);
+            }
+        }
+        ts = now_usec() - ts;
+        val_sum += sum;
+        printf(" %4d: %5.1f/%5.1f", len, ti * 1e3 / n, ts * 1e3 / rounds / n);
+        art_tree_destroy(&t);
+    }
+    printf("  ns/insert/search\n");
+}
+
+static void bench_keylen(void) {
+    for (int level = ART_SIMD_SCALAR; level <= ART_SIMD_AVX512; level++)
+        run_isolated(bench_keylen_level, level);
+}
+
+typedef void* (*search_fn)(const art_tree *t, const unsigned char *key, int key_len);
+
+static unsigned long long time_searches(art_tree *t, search_fn fn, word_info *keys, int n) {
+    uintptr_t sum = 0;
+    unsigned long long ts = now_usec();
+    for (int i = 0; i < n; i++)
+        sum += (uintptr_t)fn(t, keys[i].s, keys[i].len);
+    val_sum += sum;
+    return now_usec() - ts;
+}
+
+/**
+ * Lookups of every key of a set, comparing the prefixes on the
+ * way down and skipping them with a check at the leaf. The two
+ * take turns and each keeps its best round.
+ */
+static void bench_optimistic_set(const char *name, word_info *keys, int n) {
+    art_tree t;
+    unsigned long long ts = ~0ULL, to = ~0ULL, us;
+
+    art_tree_init(&t);
+    for (int i = 0; i < n; i++)
+        art_insert(&t, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+
+    for (int r = 0; r < 20; r++) {
+        us = time_searches(&t, art_search, keys, n);
+        if (us < ts) ts = us;
+        us = time_searches(&t, art_search_optimistic, keys, n);
+        if (us < to) to = us;
+    }
+
+    printf("%-6s pessimistic %6.1f ns/search, optimistic %6.1f ns/search, %.2fx\n",
+           name, ts * 1e3 / n, to * 1e3 / n, (double)ts / to);
+    art_tree_destroy(&t);
+}
+
+static void bench_optimistic(void) {
+    bench_optimistic_set("words", ws, nwords);
+    bench_optimistic_set("uuid", ws + nwords, total - nwords);
+}
+
+/**
+ * Node bytes per key of the word and uuid sets. Each node used
+ * to carry an 8 byte own leaf pointer, now kept in the tagged
+ * representative leaf of its header.
+ */
+static void bench_node_bytes_set(const char *name, word_info *keys, int n) {
+    art_tree t;
+    art_mem_stats m;
+    uint64_t nodes = 0, bytes = 0;
+
+    art_tree_init(&t);
+    for (int i = 0; i < n; i++)
+        art_insert(&t, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+    art_memory_usage(&t, &m);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++) {
+        nodes += m.nodes[i];
+        bytes += m.node_bytes[i];
+    }
+    printf("%-6s %8" PRIu64 " nodes %6.1f node bytes/key, %5.2f bytes/key saved\n",
+           name, nodes, (double)bytes / n, 8.0 * nodes / n);
+    art_tree_destroy(&t);
+}
+
+static void bench_node_bytes(void) {
+    bench_node_bytes_set("words", ws, nwords);
+    bench_node_bytes_set("uuid", ws + nwords, total - nwords);
+}
+
+/**
+ * Scattered lookups on the scaled up uuid set, of the keys and of
+ * the keys with their terminator changed. These follow the path
+ * of the key they come from and only miss at its leaf.
+ * Builds with and without ART_FINGERPRINTS compare how far the
+ * misses go.
+ */
+static void bench_misses(long n) {
+    art_tree t;
+    uintptr_t sum = 0;
+    unsigned long long hit = ~0ULL, miss = ~0ULL, ts;
+
+    make_uuid_keys(n);
+    art_tree_init(&t);
+    for (long i = 0; i < big_total; i++)
+        art_insert(&t, big_keys[i].s, big_keys[i].len, (void *)(uintptr_t)(i + 1));
+
+    word_info *missing = (word_info *)malloc(sizeof(word_info) * big_total + big_total * 48);
+    unsigned char *str = (unsigned char *)(missing + big_total);
+    for (long i = 0; i < big_total; i++) {
+        missing[i].s = str;
+        missing[i].len = big_keys[i].len;
+        memcpy(str, big_keys[i].s, big_keys[i].len);
+        str[big_keys[i].len - 1] = 'z';
+        str += big_keys[i].len;
+    }
+
+    for (int r = 0; r < 10; r++) {
+        // Even rounds time the hits, odd ones the misses
+        word_info *keys = (r & 1) ? missing : big_keys;
+        ts = now_usec();
+        for (long i = 0; i < big_total; i++) {
+            long k = (long)((uint64_t)i * 2147483647ULL % big_total);
+            sum += (uintptr_t)art_search(&t, keys[k].s, keys[k].len);
+        }
+        ts = now_usec() - ts;
+        if (!(r & 1) && ts < hit) hit = ts;
+        if ((r & 1) && ts < miss) miss = ts;
+    }
+    val_sum += sum;
+
+    printf("%ld keys: hits %6.1f ns/lookup, misses %6.1f ns/lookup\n",
+           big_total, hit * 1000.0 / big_total, miss * 1000.0 / big_total);
+    art_tree_destroy(&t);
+    free(missing);
+}
+
+/**
+ * Bytes per key the tree takes beyond the keys, and the
+ * lookups, of the word and uuid sets with and without
+ * ART_TREE_LEAF_BUCKETS. Buckets pack the leaves of small
+ * groups of siblings in place of a Node4 over separate leaves.
+ * The two trees are built side by side so neither gets a
+ * fresher heap, and take turns at the lookups.
+ */
+static void bench_buckets_print(const char *name, art_tree *t, word_info *keys, int n, unsigned long long ts) {
+    art_mem_stats m;
+    art_memory_usage(t, &m);
+    uint64_t bytes = m.leaf_bytes + m.prefix_bytes + m.bucket_bytes, key_bytes = 0;
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        bytes += m.node_bytes[i];
+    for (int i = 0; i < n; i++)
+        key_bytes += keys[i].len;
+    printf("%-6s %-8s %6.1f bytes/key overhead, %7" PRIu64 " buckets, %6.1f ns/search\n",
+           name, (t->flags & ART_TREE_LEAF_BUCKETS) ? "buckets" : "leaves",
+           (double)(bytes - key_bytes) / n, m.buckets, ts * 1e3 / n);
+}
+
+static void bench_buckets_set(const char *name, word_info *keys, int n) {
+    art_tree t, tb;
+    unsigned long long ts = ~0ULL, tsb = ~0ULL, us;
+
+    art_tree_init(&t);
+    art_tree_init_flags(&tb, ART_TREE_LEAF_BUCKETS);
+    for (int i = 0; i < n; i++) {
+        art_insert(&t, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+        art_insert(&tb, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+    }
+    for (int r = 0; r < 10; r++) {
+        us = time_searches(&t, art_search, keys, n);
+        if (us < ts) ts = us;
+        us = time_searches(&tb, art_search, keys, n);
+        if (us < tsb) tsb = us;
+    }
+
+    bench_buckets_print(name, &t, keys, n, ts);
+    bench_buckets_print(name, &tb, keys, n, tsb);
+    art_tree_destroy(&t);
+    art_tree_destroy(&tb);
+}
+
+static void bench_buckets(void) {
+    bench_buckets_set("words", ws, nwords);
+    bench_buckets_set("uuid", ws + nwords, total - nwords);
+}
+
+/**
+ * Bytes per key of the word and uuid sets in a tree with
+ * values and in an ART_TREE_SET, whose leaves have none.
+ */
+static void bench_set_bytes(const char *name, word_info *keys, int n, int flags) {
+    art_tree t;
+    art_mem_stats m;
+    unsigned long long ts = ~0ULL, us;
+    uintptr_t sum = 0;
+
+    art_tree_init_flags(&t, flags);
+    for (int i = 0; i < n; i++) {
+        if (flags & ART_TREE_SET)
+            art_set_insert(&t, keys[i].s, keys[i].len);
+        else
+            art_insert(&t, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+    }
+    for (int r = 0; r < 10; r++) {
+        us = now_usec();
+        for (int i = 0; i < n; i++)
+            sum += art_set_contains(&t, keys[i].s, keys[i].len);
+        us = now_usec() - us;
+        if (us < ts) ts = us;
+    }
+    val_sum += sum;
+
+    art_memory_usage(&t, &m);
+    uint64_t bytes = m.leaf_bytes + m.prefix_bytes + m.bucket_bytes;
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        bytes += m.node_bytes[i];
+    printf("%-6s %-4s %6.1f leaf bytes/key, %6.1f bytes/key, %6.1f ns/lookup\n",
+           name, (flags & ART_TREE_SET) ? "set" : "map", (double)m.leaf_bytes / n,
+           (double)bytes / n, ts * 1e3 / n);
+    art_tree_destroy(&t);
+}
+
+static void bench_set(void) {
+    bench_set_bytes("words", ws, nwords, 0);
+    bench_set_bytes("words", ws, nwords, ART_TREE_SET);
+    bench_set_bytes("uuid", ws + nwords, total - nwords, 0);
+    bench_set_bytes("uuid", ws + nwords, total - nwords, ART_TREE_SET);
+}
+
+/**
+ * Bytes per key of a set of one key length in a plain tree
+ * and in a fixed length tree, whose leaves keep no key
+ * length, with and without values.
+ */
+static void bench_fixed_bytes(const char *name, word_info *keys, int n, int fixed, int flags) {
+    art_tree t;
+    art_mem_stats m;
+    unsigned long long ts = ~0ULL, us;
+
+    if (fixed)
+        art_tree_init_fixed(&t, keys[0].len, flags);
+    else
+        art_tree_init_flags(&t, flags);
+    for (int i = 0; i < n; i++) {
+        if (flags & ART_TREE_SET)
+            art_set_insert(&t, keys[i].s, keys[i].len);
+        else
+            art_insert(&t, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+    }
+    for (int r = 0; r < 10; r++) {
+        us = time_searches(&t, art_search, keys, n);
+        if (us < ts) ts = us;
+    }
+
+    art_memory_usage(&t, &m);
+    uint64_t bytes = m.leaf_bytes + m.prefix_bytes + m.bucket_bytes;
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        bytes += m.node_bytes[i];
+    printf("%-6s %-5s %-3s %6.1f leaf bytes/key, %6.1f bytes/key, %6.1f ns/lookup\n",
+           name, fixed ? "fixed" : "plain", (flags & ART_TREE_SET) ? "set" : "map",
+           (double)m.leaf_bytes / n, (double)bytes / n, ts * 1e3 / n);
+    art_tree_destroy(&t);
+}
+
+static void bench_fixed(void) {
+    int n = 1000000;
+    word_info *ids = (word_info *)malloc(sizeof(word_info) * n + 8 * n);
+    unsigned char *str = (unsigned char *)(ids + n);
+    for (int i = 0; i < n; i++) {
+        uint64_t id = (uint64_t)i * 2654435761ULL;
+        memcpy(str + 8 * i, &id, 8);
+        ids[i].s = str + 8 * i;
+        ids[i].len = 8;
+    }
+
+    for (int set = 0; set <= ART_TREE_SET; set += ART_TREE_SET) {
+        bench_fixed_bytes("uuid", ws + nwords, total - nwords, 0, set);
+        bench_fixed_bytes("uuid", ws + nwords, total - nwords, 1, set);
+        bench_fixed_bytes("ids", ids, n, 0, set);
+        bench_fixed_bytes("ids", ids, n, 1, set);
+    }
+    free(ids);
+}
+
+/**
+ * Opens a counter of the cache misses of this process,
+ * -1 when the kernel or the machine has none.
+ */
+static int open_cache_misses(void) {
+#ifdef __linux__
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v)) return 0;
+    return v;
+}
+
+/**
+ * Lookups of every key of a set in a tree with cache line
+ * aligned nodes, and in one whose nodes come from plain malloc.
+ * The two take turns and each keeps its best round.
+ */
+static void bench_layout_set(const char *name, word_info *keys, int n, int fd) {
+    art_tree ta, tu;
+    art_allocator a = { counting_alloc, counting_free, NULL };
+    unsigned long long best_a = ~0ULL, best_u = ~0ULL, us;
+    uint64_t miss_a, miss_u;
+
+    art_tree_init(&ta);
+    art_tree_init_ex(&tu, &a, 0);
+    for (int i = 0; i < n; i++) {
+        art_insert(&ta, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+        art_insert(&tu, keys[i].s, keys[i].len, (void *)(uintptr_t)(i + 1));
+    }
+
+    for (int r = 0; r < 20; r++) {
+        us = time_searches(&ta, art_search, keys, n);
+        if (us < best_a) best_a = us;
+        us = time_searches(&tu, art_search, keys, n);
+        if (us < best_u) best_u = us;
+    }
+    miss_a = read_counter(fd);
+    time_searches(&ta, art_search, keys, n);
+    miss_a = read_counter(fd) - miss_a;
+    miss_u = read_counter(fd);
+    time_searches(&tu, art_search, keys, n);
+    miss_u = read_counter(fd) - miss_u;
+
+    printf("%-6s aligned %6.1f ns/search, malloc %6.1f ns/search, %.2fx",
+           name, best_a * 1e3 / n, best_u * 1e3 / n, (double)best_u / best_a);
+    if (fd >= 0)
+        printf(", misses/search %.2f vs %.2f\n",
+               (double)miss_a / n, (double)miss_u / n);
+    else
+        printf(", misses/search n/a\n");
+    art_tree_destroy(&ta);
+    art_tree_destroy(&tu);
+}
+
+/**
+ * Static layout of each node type, and where the line of its
+ * first child falls, then lookups with and without aligned nodes.
+ */
+static void bench_layout(void) {
+    static const char *names[ART_NUM_NODE_TYPES] = {
+        "node4", "node16", "node48", "node256", "node32", "node64"
+    };
+    art_node_layout l[ART_NUM_NODE_TYPES];
+    int types = art_node_layouts(l);
+
+    for (int i = 0; i < types; i++)
+        printf("%-8s %5u bytes %3u lines, keys at %3u, children at %3u (line %u), align %u\n",
+               names[i], l[i].size, (l[i].size + l[i].align - 1) / l[i].align,
+               l[i].keys, l[i].children, l[i].children / l[i].align, l[i].align);
+
+    int fd = open_cache_misses();
+    bench_layout_set("words", ws, nwords, fd);
+    bench_layout_set("uuid", ws + nwords, total - nwords, fd);
+    if (fd >= 0) close(fd);
+}
+
+static void bench_default(void) {
+    art_tree t;
+    uintptr_t line;
+    art_leaf *l;
+    int count;
+    unsigned long long ts;
+
+    ts = now_usec();
 
     for (int iter = 0; iter < loop; iter++) {
         art_tree_init(&t);
@@ -212,10 +1125,109 @@ int main() {
         art_tree_destroy(&t);
     }
 
-    gettimeofday(&tv, NULL);
-    ts = ((int64_t)tv.tv_sec) * 1000000 + tv.tv_usec - ts;
+    ts = now_usec() - ts;
     printf("time: %f nanoseconds [%f seconds for %d loops]\n",
            ((double)ts) * 1000 / loop, ts * 1e-6, loop);
+}
+
+int main(int argc, char **argv) {
+    int len, count;
+    off_t off;
+    unsigned char *str;
+    char buf[512];
+
+    size_t total_len = 0;
+
+    FILE *f1 = fopen("tests/words.txt", "r");
+    FILE *f2 = fopen("tests/uuid.txt", "r");
+    count = 0;
+    while (fgets(buf, sizeof buf, f1)) {
+        len = strlen(buf);
+        total_len += len;
+        count++;
+    }
+    nwords = count;
+    while (fgets(buf, sizeof buf, f2)) {
+        len = strlen(buf);
+        total_len += len;
+        count++;
+    }
+    total = count;
+    printf("read %d keys\n", total);
+
+    ws = (word_info *)malloc(sizeof(word_info) * count + total_len);
+    str = ((unsigned char *)ws) + sizeof(word_info) * count;
+
+    count = 0;
+    off = 0;
+
+    fseek(f1, 0, SEEK_SET);
+    while (fgets(buf, sizeof buf, f1)) {
+        len = strlen(buf);
+        buf[len - 1] = '\0';
+        ws[count].s = str + off;
+        ws[count].len = len;
+        memcpy(ws[count].s, buf, len);
+        count++;
+        off += len;
+    }
+
+    fseek(f2, 0, SEEK_SET);
+    while (fgets(buf, sizeof buf, f2)) {
+        len = strlen(buf);
+        buf[len - 1] = '\0';
+        ws[count].s = str + off;
+        ws[count].len = len;
+        memcpy(ws[count].s, buf, len);
+        count++;
+        off += len;
+    }
+
+    fclose(f1);
+    fclose(f2);
+
+    if (argc > 1 && !strcmp(argv[1], "arena"))
+        bench_arena();
+    else if (argc > 1 && !strcmp(argv[1], "destroy"))
+        bench_destroy();
+    else if (argc > 1 && !strcmp(argv[1], "leafpool"))
+        bench_leafpool();
+    else if (argc > 1 && !strcmp(argv[1], "nodecache"))
+        bench_nodecache();
+    else if (argc > 1 && !strcmp(argv[1], "hugepage"))
+        bench_hugepage(argc > 2 ? atol(argv[2]) : 20000000);
+    else if (argc > 1 && !strcmp(argv[1], "compact"))
+        bench_compact();
+    else if (argc > 1 && !strcmp(argv[1], "shrink"))
+        bench_shrink();
+    else if (argc > 1 && !strcmp(argv[1], "node48"))
+        bench_node48();
+    else if (argc > 1 && !strcmp(argv[1], "sparse"))
+        bench_sparse();
+    else if (argc > 1 && !strcmp(argv[1], "wide"))
+        bench_wide();
+    else if (argc > 1 && !strcmp(argv[1], "simd"))
+        bench_simd();
+    else if (argc > 1 && !strcmp(argv[1], "keylen"))
+        bench_keylen();
+    else if (argc > 1 && !strcmp(argv[1], "optimistic"))
+        bench_optimistic();
+    else if (argc > 1 && !strcmp(argv[1], "nodebytes"))
+        bench_node_bytes();
+    else if (argc > 1 && !strcmp(argv[1], "layout"))
+        bench_layout();
+    else if (argc > 1 && !strcmp(argv[1], "prefetch"))
+        bench_prefetch(argc > 2 ? atol(argv[2]) : 10000000);
+    else if (argc > 1 && !strcmp(argv[1], "misses"))
+        bench_misses(argc > 2 ? atol(argv[2]) : 5000000);
+    else if (argc > 1 && !strcmp(argv[1], "buckets"))
+        bench_buckets();
+    else if (argc > 1 && !strcmp(argv[1], "set"))
+        bench_set();
+    else if (argc > 1 && !strcmp(argv[1], "fixed"))
+        bench_fixed();
+    else
+        bench_default();
 
     return val_sum >> 24;
 }
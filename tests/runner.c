@@ -25,6 +25,32 @@ int main(void)
     tcase_add_test(tc1, test_art_long_prefix);
     tcase_add_test(tc1, test_art_insert_search_uuid);
     tcase_add_test(tc1, test_art_max_prefix_len_scan_prefix);
+    tcase_add_test(tc1, test_art_arena_insert_delete);
+    tcase_add_test(tc1, test_art_custom_allocator);
+    tcase_add_test(tc1, test_art_region_clear);
+    tcase_add_test(tc1, test_art_leaf_pool_reuse);
+    tcase_add_test(tc1, test_art_node_cache);
+    tcase_add_test(tc1, test_art_hugepage_insert_search);
+    tcase_add_test(tc1, test_art_memory_usage);
+    tcase_add_test(tc1, test_art_compact);
+    tcase_add_test(tc1, test_art_tree_shrink);
+    tcase_add_test(tc1, test_art_node48_slot_reuse);
+    tcase_add_test(tc1, test_art_wide_node_min_max);
+    tcase_add_test(tc1, test_art_wide_nodes);
+    tcase_add_test(tc1, test_art_simd_levels);
+    tcase_add_test(tc1, test_art_long_key_mismatch);
+    tcase_add_test(tc1, test_art_long_prefixes);
+    tcase_add_test(tc1, test_art_optimistic_search);
+    tcase_add_test(tc1, test_art_rep_leaf_churn);
+    tcase_add_test(tc1, test_art_own_leaf_delete);
+    tcase_add_test(tc1, test_art_node_layouts);
+    tcase_add_test(tc1, test_art_prefetch);
+    tcase_add_test(tc1, test_art_leaf_misses);
+    tcase_add_test(tc1, test_art_leaf_buckets);
+    tcase_add_test(tc1, test_art_set);
+    tcase_add_test(tc1, test_art_fixed_keys);
+    tcase_add_test(tc1, test_art_iter_own_leaves);
+    tcase_add_test(tc1, test_art_full_node256_rep);
     tcase_set_timeout(tc1, 180);
 
     srunner_run_all(sr, CK_ENV);
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "check.h"
@@ -514,3 +515,1459 @@ START_TEST(test_art_max_prefix_len_scan_prefix)
     fail_unless(res == 0);
 }
 END_TEST
+
+START_TEST(test_art_arena_insert_delete)
+{
+    art_tree t;
+    int res = art_tree_init_flags(&t, ART_TREE_ARENA);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1, nlines;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+    nlines = line - 1;
+
+    // Delete everything, the freed nodes go back to the arena
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_delete(&t, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+        line++;
+    }
+    fail_unless(art_size(&t) == 0);
+
+    // Insert again, reusing the recycled nodes
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+    fail_unless(art_size(&t) == nlines);
+
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+        line++;
+    }
+    fclose(f);
+
+    art_leaf *l = art_minimum(&t);
+    fail_unless(l && strcmp((char*)l->key, "A") == 0);
+    l = art_maximum(&t);
+    fail_unless(l && strcmp((char*)l->key, "zythum") == 0);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    int64_t bytes;
+} counting_allocator;
+
+static void* counting_alloc(void *ctx, size_t size) {
+    counting_allocator *c = (counting_allocator*)ctx;
+    c->allocs++;
+    c->bytes += size;
+    return malloc(size);
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+    counting_allocator *c = (counting_allocator*)ctx;
+    c->frees++;
+    c->bytes -= size;
+    free(ptr);
+}
+
+START_TEST(test_art_custom_allocator)
+{
+    counting_allocator c = { 0, 0, 0 };
+    art_allocator a = { counting_alloc, counting_free, &c };
+    int flags[] = { 0, ART_TREE_ARENA };
+
+    for (int i = 0; i < 2; i++) {
+        art_tree t;
+        int res = art_tree_init_ex(&t, &a, flags[i]);
+        fail_unless(res == 0);
+
+        int len;
+        char buf[512];
+        FILE *f = fopen("tests/words.txt", "r");
+
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        fail_unless(c.allocs > 0);
+        fail_unless(c.bytes > 0);
+
+        // Delete every other key, both the leaves and the
+        // shrunk nodes must be handed back with their size
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line & 1) {
+                uintptr_t val = (uintptr_t)art_delete(&t, (unsigned char*)buf, len);
+                fail_unless(line == val);
+            }
+            line++;
+        }
+
+        // Own leaves, keys that are a prefix of another key
+        unsigned char key1[2] = {'a', 'b'};
+        unsigned char key2[1] = {'a'};
+        art_insert(&t, key1, sizeof(key1), NULL);
+        art_insert(&t, key2, sizeof(key2), NULL);
+        fclose(f);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+        fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+        fail_unless(c.allocs == c.frees);
+    }
+}
+END_TEST
+
+START_TEST(test_art_region_clear)
+{
+    counting_allocator c = { 0, 0, 0 };
+    art_allocator a = { counting_alloc, counting_free, &c };
+    art_tree t;
+    int res = art_tree_init_ex(&t, &a, ART_TREE_REGION);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    // A key too big for a slab
+    unsigned char big[20000];
+    memset(big, 'x', sizeof(big));
+
+    for (int round = 0; round < 2; round++) {
+        fseek(f, 0, SEEK_SET);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        fail_unless(NULL == art_insert(&t, big, sizeof(big), (void*)line));
+        fail_unless(line == (uintptr_t)art_search(&t, big, sizeof(big)));
+        fail_unless(art_size(&t) == line);
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+            fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+                val, buf);
+            if (line % 3 == 0)
+                fail_unless(line == (uintptr_t)art_delete(&t, (unsigned char*)buf, len));
+            line++;
+        }
+
+        // Clearing keeps the slabs, the big block is released
+        int64_t bytes = c.bytes;
+        fail_unless(art_tree_clear(&t) == 0);
+        fail_unless(art_size(&t) == 0);
+        fail_unless(!art_minimum(&t));
+        fail_unless(!art_search(&t, (unsigned char*)"A", 2));
+#ifndef ART_COMPACT_REFS
+        // Compact builds keep the whole region in their reservation
+        fail_unless(c.bytes > 0 && c.bytes < bytes);
+#else
+        (void)bytes;
+#endif
+    }
+    fclose(f);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+    fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+}
+END_TEST
+
+START_TEST(test_art_leaf_pool_reuse)
+{
+    counting_allocator c = { 0, 0, 0 };
+    art_allocator a = { counting_alloc, counting_free, &c };
+    art_tree t;
+    int res = art_tree_init_ex(&t, &a, ART_TREE_ARENA | ART_TREE_LEAF_POOL);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    uint64_t allocs = 0;
+
+    for (int round = 0; round < 3; round++) {
+        allocs = c.allocs;
+        fseek(f, 0, SEEK_SET);
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+
+        // Once the pool is warm, reinserting takes nothing
+        // from the allocator
+        if (round)
+            fail_unless(c.allocs == allocs, "Allocs: %" PRIu64 " Before: %" PRIu64,
+                    c.allocs, allocs);
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_delete(&t, (unsigned char*)buf, len);
+            fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+                val, buf);
+            line++;
+        }
+        fail_unless(art_size(&t) == 0);
+    }
+    fclose(f);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+    fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+}
+END_TEST
+
+START_TEST(test_art_node_cache)
+{
+    counting_allocator c = { 0, 0, 0 };
+    art_allocator a = { counting_alloc, counting_free, &c };
+    art_tree t;
+    int res = art_tree_init_ex(&t, &a, ART_TREE_NODE_CACHE | ART_TREE_NARROW_NODES);
+    fail_unless(res == 0);
+
+    // Swing the root between Node48 and Node256
+    unsigned char key[2] = {'k', 0};
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 49; i++) {
+            key[1] = i;
+            art_insert(&t, key, 2, NULL);
+        }
+        for (int i = 48; i >= 36; i--) {
+            key[1] = i;
+            art_delete(&t, key, 2);
+        }
+    }
+    fail_unless(art_size(&t) == 36);
+
+    art_cache_stats stats;
+    fail_unless(art_node_cache_stats(&t, &stats) == 0);
+    fail_unless(stats.misses[3] == 1, "Misses: %" PRIu64, stats.misses[3]);
+    fail_unless(stats.hits[3] == 9, "Hits: %" PRIu64, stats.hits[3]);
+    fail_unless(stats.hits[2] >= 9, "Hits: %" PRIu64, stats.hits[2]);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+    fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+}
+END_TEST
+
+START_TEST(test_art_hugepage_insert_search)
+{
+    art_tree t;
+    int res = art_tree_init_flags(&t, ART_TREE_HUGEPAGE);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/uuid.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+        if (!(line & 1))
+            fail_unless(line == (uintptr_t)art_delete(&t, (unsigned char*)buf, len));
+        line++;
+    }
+    fclose(f);
+
+    art_leaf *l = art_minimum(&t);
+    fail_unless(l && strcmp((char*)l->key, "00026bda-e0ea-4cda-8245-522764e9f325") == 0);
+    l = art_maximum(&t);
+    fail_unless(l && strcmp((char*)l->key, "ffffcb46-a92e-4822-82af-a7190f9c1ec5") == 0);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_memory_usage)
+{
+    counting_allocator c = { 0, 0, 0 };
+    art_allocator a = { counting_alloc, counting_free, &c };
+    art_tree t;
+    art_mem_stats m;
+    int res = art_tree_init_ex(&t, &a, 0);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    uint64_t keys = 0;
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        keys += len;
+        line++;
+    }
+
+    fail_unless(art_memory_usage(&t, &m) == 0);
+    fail_unless(m.leaves == art_size(&t));
+    fail_unless(m.key_bytes == keys);
+    uint64_t bytes = m.leaf_bytes + m.prefix_bytes;
+    fail_unless(m.nodes[0] > 0);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        bytes += m.node_bytes[i];
+#ifndef ART_COMPACT_REFS
+    // Everything the tree holds comes straight from the allocator
+    fail_unless(bytes == (uint64_t)c.bytes, "Bytes: %" PRIu64 " Allocated: %" PRId64,
+            bytes, c.bytes);
+#endif
+
+    fseek(f, 0, SEEK_SET);
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL != art_delete(&t, (unsigned char*)buf, len));
+    }
+    fclose(f);
+
+    art_memory_usage(&t, &m);
+    fail_unless(m.leaves == 0 && m.leaf_bytes == 0 && m.key_bytes == 0);
+    fail_unless(m.prefix_bytes == 0);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        fail_unless(m.nodes[i] == 0 && m.node_bytes[i] == 0);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_compact)
+{
+    int flags[] = { 0, ART_TREE_ARENA | ART_TREE_LEAF_POOL, ART_TREE_REGION };
+    for (int i = 0; i < 3; i++) {
+        counting_allocator c = { 0, 0, 0 };
+        art_allocator a = { counting_alloc, counting_free, &c };
+        art_tree t;
+        art_mem_stats before, after;
+        int res = art_tree_init_ex(&t, &a, flags[i]);
+        fail_unless(res == 0);
+
+        int len;
+        char buf[512];
+        FILE *f = fopen("tests/words.txt", "r");
+
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line % 2)
+                fail_unless(line == (uintptr_t)art_delete(&t, (unsigned char*)buf, len));
+            line++;
+        }
+
+        // A part at a time, then the whole tree
+        art_memory_usage(&t, &before);
+        fail_unless(art_compact_prefix(&t, (unsigned char*)"A", 1) == 0);
+        fail_unless(art_compact_prefix(&t, (unsigned char*)"ab", 2) == 0);
+        fail_unless(art_compact_prefix(&t, (unsigned char*)"zzzzzz", 6) == 0);
+        fail_unless(art_compact(&t) == 0);
+        art_memory_usage(&t, &after);
+        fail_unless(!memcmp(&before, &after, sizeof(before)));
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+            fail_unless(val == (line % 2 ? 0 : line), "Line: %d Val: %" PRIuPTR " Str: %s\n",
+                line, val, buf);
+            line++;
+        }
+        fclose(f);
+        fail_unless(art_size(&t) == (line - 1) / 2);
+
+        uint64_t out[] = {0, 0};
+        fail_unless(art_iter(&t, iter_cb, &out) == 0);
+        fail_unless(out[0] == art_size(&t));
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+        fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+    }
+}
+END_TEST
+
+START_TEST(test_art_tree_shrink)
+{
+    int flags[] = { ART_TREE_REGION, ART_TREE_ARENA | ART_TREE_LEAF_POOL, 0 };
+    for (int i = 0; i < 3; i++) {
+        counting_allocator c = { 0, 0, 0 };
+        art_allocator a = { counting_alloc, counting_free, &c };
+        art_tree t;
+        int res = art_tree_init_ex(&t, &a, flags[i]);
+        fail_unless(res == 0);
+
+        int len;
+        char buf[512];
+        FILE *f = fopen("tests/words.txt", "r");
+
+        uintptr_t line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL ==
+                art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            if (line % 10)
+                fail_unless(line == (uintptr_t)art_delete(&t, (unsigned char*)buf, len));
+            line++;
+        }
+
+        int64_t bytes = c.bytes;
+        size_t released = art_tree_shrink(&t);
+        if (t.arena)
+            fail_unless(released > 0);
+        else
+            fail_unless(released == 0);
+#ifndef ART_COMPACT_REFS
+        if (t.arena)
+            fail_unless(c.bytes < bytes, "Bytes: %" PRId64 " Before: %" PRId64, c.bytes, bytes);
+#else
+        (void)bytes;
+#endif
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+            fail_unless(val == (line % 10 ? 0 : line), "Line: %d Val: %" PRIuPTR " Str: %s\n",
+                line, val, buf);
+            if (line % 10)
+                fail_unless(NULL ==
+                    art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            line++;
+        }
+        fclose(f);
+        fail_unless(art_size(&t) == line - 1);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+        fail_unless(c.bytes == 0, "Leaked: %" PRId64, c.bytes);
+    }
+}
+END_TEST
+
+START_TEST(test_art_node48_slot_reuse)
+{
+    art_tree t;
+    unsigned char key[2] = {'k', 0};
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    // A Node48 with holes left by deletes in the middle of its slots
+    for (int i = 0; i < 40; i++) {
+        key[1] = i;
+        fail_unless(NULL == art_insert(&t, key, 2, (void*)(uintptr_t)(i + 1)));
+    }
+    for (int i = 5; i < 25; i += 2) {
+        key[1] = i;
+        fail_unless((uintptr_t)art_delete(&t, key, 2) == (uintptr_t)(i + 1));
+    }
+    for (int i = 100; i < 118; i++) {
+        key[1] = i;
+        fail_unless(NULL == art_insert(&t, key, 2, (void*)(uintptr_t)(i + 1)));
+    }
+    fail_unless(art_size(&t) == 48);
+
+    for (int i = 0; i < 256; i++) {
+        key[1] = i;
+        uintptr_t val = (uintptr_t)art_search(&t, key, 2);
+        int present = (i < 40 && !(i >= 5 && i < 25 && i % 2)) || (i >= 100 && i < 118);
+        fail_unless(val == (present ? (uintptr_t)(i + 1) : 0), "Key: %d Val: %" PRIuPTR, i, val);
+    }
+
+    // Grow into a Node256 and back
+    key[1] = 200;
+    fail_unless(NULL == art_insert(&t, key, 2, (void*)201));
+    for (int i = 100; i < 118; i++) {
+        key[1] = i;
+        fail_unless((uintptr_t)art_delete(&t, key, 2) == (uintptr_t)(i + 1));
+    }
+    for (int i = 120; i < 130; i++) {
+        key[1] = i;
+        fail_unless(NULL == art_insert(&t, key, 2, (void*)(uintptr_t)(i + 1)));
+    }
+    for (int i = 120; i < 130; i++) {
+        key[1] = i;
+        fail_unless((uintptr_t)art_search(&t, key, 2) == (uintptr_t)(i + 1));
+    }
+    fail_unless(art_size(&t) == 41);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_wide_node_min_max)
+{
+    art_tree t;
+    unsigned char key[2] = {'k', 0};
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    // Sparse keys, as a Node48 and then as a Node256
+    for (int n = 20; n <= 60; n += 40) {
+        for (int i = 0; i < n; i++) {
+            key[1] = 3 + i * 4;
+            art_insert(&t, key, 2, NULL);
+        }
+        for (int lo = 3, hi = 3 + (n - 1) * 4; lo < hi; lo += 4, hi -= 4) {
+            art_leaf *l = art_minimum(&t);
+            fail_unless(l && l->key[1] == lo, "Min: %d Expected: %d", l->key[1], lo);
+            l = art_maximum(&t);
+            fail_unless(l && l->key[1] == hi, "Max: %d Expected: %d", l->key[1], hi);
+
+            uint64_t out[] = {0, 0};
+            fail_unless(art_iter(&t, iter_cb, &out) == 0);
+            fail_unless(out[0] == art_size(&t));
+
+            key[1] = lo;
+            art_delete(&t, key, 2);
+            key[1] = hi;
+            art_delete(&t, key, 2);
+        }
+        art_tree_clear(&t);
+    }
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_wide_nodes)
+{
+    int flags[] = {
+        ART_TREE_NARROW_NODES,
+        ART_TREE_NARROW_NODES | ART_TREE_NODE32,
+        ART_TREE_NARROW_NODES | ART_TREE_NODE64,
+        0
+    };
+    for (int f = 0; f < 4; f++) {
+        art_tree t;
+        unsigned char key[2] = {'k', 0};
+        int res = art_tree_init_flags(&t, flags[f]);
+        fail_unless(res == 0);
+
+        // Grow one node through every type and shrink it back
+        for (int i = 0; i < 256; i++) {
+            key[1] = (i * 7) & 0xff;
+            fail_unless(NULL == art_insert(&t, key, 2, (void*)(uintptr_t)(key[1] + 1)));
+            for (int j = 0; j <= i; j++) {
+                key[1] = (j * 7) & 0xff;
+                fail_unless((uintptr_t)art_search(&t, key, 2) == (uintptr_t)(key[1] + 1));
+            }
+        }
+        fail_unless(art_minimum(&t)->key[1] == 0);
+        fail_unless(art_maximum(&t)->key[1] == 255);
+        for (int i = 255; i > 0; i--) {
+            key[1] = (i * 7) & 0xff;
+            fail_unless((uintptr_t)art_delete(&t, key, 2) == (uintptr_t)(key[1] + 1));
+            fail_unless(art_size(&t) == (uint64_t)i);
+
+            uint64_t out[] = {0, 0};
+            fail_unless(art_iter(&t, iter_cb, &out) == 0);
+            fail_unless(out[0] == (uint64_t)i);
+            for (int j = 0; j < i; j++) {
+                key[1] = (j * 7) & 0xff;
+                fail_unless((uintptr_t)art_search(&t, key, 2) == (uintptr_t)(key[1] + 1));
+            }
+        }
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_art_simd_levels)
+{
+    int levels = 0;
+    for (int level = ART_SIMD_SCALAR; level <= ART_SIMD_AVX512; level++) {
+        if (art_simd_force(level))
+            continue;
+        fail_unless(art_simd_level() == level);
+        levels++;
+
+        art_tree t;
+        unsigned char key[2] = {'k', 0};
+        int res = art_tree_init_flags(&t, ART_TREE_NARROW_NODES | ART_TREE_NODE64);
+        fail_unless(res == 0);
+
+        // Bytes above 0x7f must sort after the others
+        for (int i = 0; i < 64; i++) {
+            key[1] = (i * 37 + 100) & 0xff;
+            fail_unless(NULL == art_insert(&t, key, 2, (void*)(uintptr_t)(key[1] + 1)));
+            for (int j = 0; j <= i; j++) {
+                key[1] = (j * 37 + 100) & 0xff;
+                fail_unless((uintptr_t)art_search(&t, key, 2) == (uintptr_t)(key[1] + 1));
+            }
+        }
+
+        // Every byte not inserted misses
+        int hits = 0;
+        for (int c = 0; c < 256; c++) {
+            key[1] = c;
+            uintptr_t val = (uintptr_t)art_search(&t, key, 2);
+            fail_unless(val == 0 || val == (uintptr_t)(c + 1));
+            hits += val != 0;
+        }
+        fail_unless(hits == 64);
+
+        uint64_t out[] = {0, 0};
+        fail_unless(art_iter(&t, iter_cb, &out) == 0);
+        fail_unless(out[0] == 64);
+        fail_unless(art_minimum(&t)->key[1] == 1);
+        fail_unless(art_maximum(&t)->key[1] == 254);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+    fail_unless(levels >= 1);
+    fail_unless(art_simd_force(ART_SIMD_AUTO) == 0);
+}
+END_TEST
+
+START_TEST(test_art_long_key_mismatch)
+{
+    for (int level = ART_SIMD_SCALAR; level <= ART_SIMD_AVX512; level++) {
+        if (art_simd_force(level))
+            continue;
+
+        art_tree t;
+        unsigned char key[300];
+        int res = art_tree_init(&t);
+        fail_unless(res == 0);
+
+        // Keys that differ from each other at a single byte
+        for (int i = 0; i < 300; i++) {
+            memset(key, 'a', sizeof(key));
+            key[i] = 'b';
+            fail_unless(NULL == art_insert(&t, key, sizeof(key), (void*)(uintptr_t)(i + 1)));
+        }
+        for (int i = 0; i < 300; i++) {
+            memset(key, 'a', sizeof(key));
+            key[i] = 'b';
+            fail_unless((uintptr_t)art_search(&t, key, sizeof(key)) == (uintptr_t)(i + 1));
+            key[i] = 'c';
+            fail_unless(art_search(&t, key, sizeof(key)) == NULL);
+            key[i] = 'b';
+            key[299 - i] = 'c';
+            fail_unless(art_search(&t, key, sizeof(key)) == NULL);
+        }
+        memset(key, 'a', sizeof(key));
+        fail_unless(art_search(&t, key, sizeof(key)) == NULL);
+        fail_unless(art_size(&t) == 300);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+    fail_unless(art_simd_force(ART_SIMD_AUTO) == 0);
+}
+END_TEST
+
+START_TEST(test_art_long_prefixes)
+{
+    art_tree t;
+    art_mem_stats m;
+    char buf[128];
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    // Splits deep inside prefixes longer than a node holds
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(buf, sizeof(buf),
+                "this:key:has:a:long:common:prefix:%d:and:a:long:middle:%d:%d",
+                i % 7, i % 3, i) + 1;
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)(uintptr_t)(i + 1)));
+    }
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(buf, sizeof(buf),
+                "this:key:has:a:long:common:prefix:%d:and:a:long:middle:%d:%d",
+                i % 7, i % 3, i) + 1;
+        fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == (uintptr_t)(i + 1));
+        buf[20] = 'X';
+        fail_unless(art_search(&t, (unsigned char*)buf, len) == NULL);
+    }
+
+    // Deletes merge the prefixes back together
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(buf, sizeof(buf),
+                "this:key:has:a:long:common:prefix:%d:and:a:long:middle:%d:%d",
+                i % 7, i % 3, i) + 1;
+        fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == (uintptr_t)(i + 1));
+        if (i % 100 == 99) {
+            for (int j = i + 1; j < 1000; j += 37) {
+                len = snprintf(buf, sizeof(buf),
+                        "this:key:has:a:long:common:prefix:%d:and:a:long:middle:%d:%d",
+                        j % 7, j % 3, j) + 1;
+                fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == (uintptr_t)(j + 1));
+            }
+        }
+    }
+    fail_unless(art_size(&t) == 0);
+    art_memory_usage(&t, &m);
+    fail_unless(m.prefix_bytes == 0);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++)
+        fail_unless(m.nodes[i] == 0);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_optimistic_search)
+{
+    art_tree t, o;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+    res = art_tree_init_flags(&o, ART_TREE_OPTIMISTIC);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        fail_unless(NULL == art_insert(&o, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    // Hits, and misses in the skipped prefixes, past the
+    // end of the paths, and on prefixes of the keys
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless((uintptr_t)art_search(&o, (unsigned char*)buf, len) == line);
+        fail_unless((uintptr_t)art_search_optimistic(&t, (unsigned char*)buf, len) == line);
+
+        for (int i = 0; i < len; i++) {
+            char c = buf[i];
+            buf[i] = 'Z';
+            fail_unless(art_search(&o, (unsigned char*)buf, len) ==
+                    art_search(&t, (unsigned char*)buf, len));
+            buf[i] = c;
+            fail_unless(art_search(&o, (unsigned char*)buf, i) ==
+                    art_search(&t, (unsigned char*)buf, i));
+        }
+        buf[len] = 'Z';
+        fail_unless(art_search(&o, (unsigned char*)buf, len+1) == NULL);
+        line++;
+    }
+    fclose(f);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+    res = art_tree_destroy(&o);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int rep_key(char *buf, int tenant, int i) {
+    return snprintf(buf, 128, "tenant:%02d:with:a:long:shared:path:%05d", tenant, i) + 1;
+}
+
+START_TEST(test_art_rep_leaf_churn)
+{
+    art_tree t;
+    char buf[128];
+    int len, res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    for (int i = 0; i < 2000; i++) {
+        len = rep_key(buf, i % 10, i);
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)(uintptr_t)(i + 1)));
+    }
+
+    // Delete the leaves the nodes were first pointed at
+    for (int i = 0; i < 2000; i += 2) {
+        len = rep_key(buf, i % 10, i);
+        fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == (uintptr_t)(i + 1));
+    }
+    art_compact_prefix(&t, (unsigned char*)"tenant:03", 9);
+
+    // Splits inside the long prefixes read them from the leaves
+    for (int i = 0; i < 10; i++) {
+        len = snprintf(buf, sizeof(buf), "tenant:%02d:with:a:long:other:path", i) + 1;
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)(uintptr_t)(5000 + i)));
+    }
+    for (int i = 1; i < 2000; i += 2) {
+        len = rep_key(buf, i % 10, i);
+        fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == (uintptr_t)(i + 1));
+    }
+
+    uint64_t out[] = {0, 0};
+    fail_unless(art_iter_prefix(&t, (unsigned char*)"tenant:05:with:a:long:", 22, iter_cb, &out) == 0);
+    fail_unless(out[0] == 201);
+    fail_unless(art_size(&t) == 1010);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_own_leaf_delete)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    // "ab" is the own leaf of the node holding "abc" and "abd"
+    fail_unless(NULL == art_insert(&t, (unsigned char*)"ab", 2, (void*)1));
+    fail_unless(NULL == art_insert(&t, (unsigned char*)"abc", 3, (void*)2));
+    fail_unless(NULL == art_insert(&t, (unsigned char*)"abd", 3, (void*)3));
+    fail_unless(NULL == art_insert(&t, (unsigned char*)"abdxyz", 6, (void*)4));
+
+    fail_unless(art_delete(&t, (unsigned char*)"abc", 3) == (void*)2);
+    fail_unless(art_search(&t, (unsigned char*)"ab", 2) == (void*)1);
+    fail_unless(art_search(&t, (unsigned char*)"abd", 3) == (void*)3);
+    fail_unless(art_search(&t, (unsigned char*)"abdxyz", 6) == (void*)4);
+
+    fail_unless(art_delete(&t, (unsigned char*)"abd", 3) == (void*)3);
+    fail_unless(art_delete(&t, (unsigned char*)"abdxyz", 6) == (void*)4);
+    fail_unless(art_search(&t, (unsigned char*)"ab", 2) == (void*)1);
+    fail_unless(art_minimum(&t) == art_maximum(&t));
+    fail_unless(art_size(&t) == 1);
+
+    fail_unless(art_delete(&t, (unsigned char*)"ab", 2) == (void*)1);
+    fail_unless(art_size(&t) == 0);
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_node_layouts)
+{
+    art_node_layout l[ART_NUM_NODE_TYPES];
+    fail_unless(art_node_layouts(l) == ART_NUM_NODE_TYPES);
+    for (int i = 0; i < ART_NUM_NODE_TYPES; i++) {
+        fail_unless(l[i].align && !(l[i].align & (l[i].align - 1)));
+        fail_unless(l[i].keys < l[i].children);
+        fail_unless(l[i].children < l[i].size);
+    }
+
+    // The keys and first child of a Node4 share its first line
+    fail_unless(l[0].children + sizeof(void*) <= l[0].align);
+}
+END_TEST
+
+START_TEST(test_art_prefetch)
+{
+    art_tree t, p;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+    res = art_tree_init_flags(&p, ART_TREE_PREFETCH);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        fail_unless(NULL == art_insert(&p, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless((uintptr_t)art_search(&p, (unsigned char*)buf, len) == line);
+        fail_unless(art_search(&p, (unsigned char*)buf, len-1) ==
+                art_search(&t, (unsigned char*)buf, len-1));
+        line++;
+    }
+    fclose(f);
+
+    // Prefix scans see the same keys
+    const char *prefixes[] = {"a", "ab", "inter", "zz", "qqq"};
+    for (int i = 0; i < 5; i++) {
+        uint64_t out_t[2] = {0, 0}, out_p[2] = {0, 0};
+        int plen = strlen(prefixes[i]);
+        fail_unless(!art_iter_prefix(&t, (unsigned char*)prefixes[i], plen, iter_cb, out_t));
+        fail_unless(!art_iter_prefix(&p, (unsigned char*)prefixes[i], plen, iter_cb, out_p));
+        fail_unless(out_t[0] == out_p[0] && out_t[1] == out_p[1]);
+    }
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+    res = art_tree_destroy(&p);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_leaf_misses)
+{
+    art_tree t;
+    int res = art_tree_init(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    // Keys that follow the path of a word down to its leaf, then
+    // miss, and after deleting every other word, which collapses
+    // nodes into leaves
+    for (int pass = 0; pass < 2; pass++) {
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            int present = !pass || (line & 1);
+            fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == (present ? line : 0));
+            buf[len-1] = '!';
+            fail_unless(art_search(&t, (unsigned char*)buf, len) == NULL);
+            fail_unless(art_delete(&t, (unsigned char*)buf, len) == NULL);
+            buf[len-1] = '\0';
+            if (!pass && !(line & 1))
+                fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == line);
+            line++;
+        }
+    }
+    fclose(f);
+
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    uint64_t count;
+    unsigned char last[512];
+    uint32_t last_len;
+} order_data;
+
+static int order_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    order_data *o = (order_data*)data;
+    uint32_t len = o->last_len < k_len ? o->last_len : k_len;
+    fail_unless(!o->count || memcmp(o->last, k, len) < 0, "Key: %s After: %s", k, o->last);
+    memcpy(o->last, k, k_len);
+    o->last_len = k_len;
+    o->count++;
+    return 0;
+}
+
+START_TEST(test_art_leaf_buckets)
+{
+    art_tree plain;
+    fail_unless(art_tree_init(&plain) == 0);
+
+    int flags[] = { 0, ART_TREE_ARENA | ART_TREE_LEAF_POOL, ART_TREE_REGION };
+    for (int i = 0; i < 3; i++) {
+        art_tree t;
+        art_mem_stats before, after;
+        int res = art_tree_init_flags(&t, flags[i] | ART_TREE_LEAF_BUCKETS);
+        fail_unless(res == 0);
+
+        int len;
+        char buf[512];
+        FILE *f = fopen("tests/words.txt", "r");
+
+        uintptr_t line = 1, nlines;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+            if (!i)
+                art_insert(&plain, (unsigned char*)buf, len, (void*)line);
+            line++;
+        }
+        nlines = line - 1;
+        art_memory_usage(&t, &before);
+        fail_unless(before.buckets > 0);
+        fail_unless(before.leaves < nlines);
+
+        // Bucket leaves come out in key order like any others
+        order_data o = { 0, {0}, 0 };
+        fail_unless(art_iter(&t, order_cb, &o) == 0);
+        fail_unless(o.count == nlines);
+        uint64_t out[] = {0, 0}, plain_out[] = {0, 0};
+        art_iter_prefix(&t, (unsigned char*)"ab", 2, iter_cb, out);
+        art_iter_prefix(&plain, (unsigned char*)"ab", 2, iter_cb, plain_out);
+        fail_unless(out[0] > 0 && !memcmp(out, plain_out, sizeof(out)));
+        fail_unless(art_minimum(&t)->value == art_minimum(&plain)->value);
+        fail_unless(art_maximum(&t)->value == art_maximum(&plain)->value);
+
+        // Search all, then delete every other key
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == line);
+            fail_unless((uintptr_t)art_insert(&t, (unsigned char*)buf, len, (void*)line) == line);
+            if (line % 2)
+                fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == line);
+            line++;
+        }
+
+        art_memory_usage(&t, &before);
+        fail_unless(art_compact(&t) == 0);
+        art_memory_usage(&t, &after);
+        fail_unless(!memcmp(&before, &after, sizeof(before)));
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+            fail_unless(val == (line % 2 ? 0 : line), "Line: %d Val: %" PRIuPTR " Str: %s\n",
+                line, val, buf);
+            if (!(line % 2))
+                fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == line);
+            line++;
+        }
+        fclose(f);
+
+        art_memory_usage(&t, &after);
+        fail_unless(art_size(&t) == 0);
+        fail_unless(after.buckets == 0 && after.bucket_bytes == 0);
+        fail_unless(after.leaves == 0 && after.key_bytes == 0);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+
+    // Keys apart early with long tails stay leaves, and
+    // the same tails past a long shared start share buckets
+    art_tree t;
+    art_mem_stats m;
+    fail_unless(art_tree_init_flags(&t, ART_TREE_LEAF_BUCKETS) == 0);
+    unsigned char key[40];
+    memset(key, 'x', sizeof(key));
+    for (int i = 0; i < 64; i++) {
+        key[0] = 'a' + i / 8;
+        key[1] = 'a' + i % 8;
+        fail_unless(NULL == art_insert(&t, key, sizeof(key), (void*)(uintptr_t)(i + 1)));
+    }
+    art_memory_usage(&t, &m);
+    fail_unless(m.buckets == 0 && m.leaves == 64);
+    for (int i = 0; i < 64; i++) {
+        key[0] = key[1] = 'z';
+        key[sizeof(key)-2] = 'a' + i / 8;
+        key[sizeof(key)-1] = 'a' + i % 8;
+        fail_unless(NULL == art_insert(&t, key, sizeof(key), (void*)(uintptr_t)(i + 65)));
+    }
+    art_memory_usage(&t, &m);
+    fail_unless(m.buckets > 0 && m.leaves < 128);
+    for (int i = 0; i < 64; i++) {
+        key[sizeof(key)-2] = 'a' + i / 8;
+        key[sizeof(key)-1] = 'a' + i % 8;
+        fail_unless((uintptr_t)art_search(&t, key, sizeof(key)) == (uintptr_t)(i + 65));
+    }
+    fail_unless(art_tree_destroy(&t) == 0);
+
+    fail_unless(art_tree_destroy(&plain) == 0);
+}
+END_TEST
+
+static int set_order_cb(void *data, const unsigned char *k, uint32_t k_len) {
+    return order_cb(data, k, k_len, NULL);
+}
+
+START_TEST(test_art_set)
+{
+    int flags[] = { 0, ART_TREE_ARENA | ART_TREE_LEAF_POOL, ART_TREE_REGION, ART_TREE_LEAF_BUCKETS };
+    for (int i = 0; i < 4; i++) {
+        art_tree t, plain;
+        art_mem_stats m, plain_m;
+        int res = art_tree_init_flags(&t, flags[i] | ART_TREE_SET);
+        fail_unless(res == 0);
+        fail_unless(art_tree_init_flags(&plain, flags[i]) == 0);
+
+        int len;
+        char buf[512];
+        FILE *f = fopen("tests/words.txt", "r");
+
+        uintptr_t line = 1, nlines;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(art_set_insert(&t, (unsigned char*)buf, len) == 1);
+            fail_unless(art_set_insert(&t, (unsigned char*)buf, len) == 0);
+            art_insert(&plain, (unsigned char*)buf, len, (void*)line);
+            line++;
+        }
+        nlines = line - 1;
+        fail_unless(art_size(&t) == nlines);
+
+        // Same tree, leaves without their value
+        art_memory_usage(&t, &m);
+        art_memory_usage(&plain, &plain_m);
+        fail_unless(m.leaves == plain_m.leaves);
+        fail_unless(m.leaf_bytes < plain_m.leaf_bytes);
+        fail_unless(m.buckets == plain_m.buckets);
+        fail_unless(!m.buckets || m.bucket_bytes < plain_m.bucket_bytes);
+        fail_unless(!memcmp(m.node_bytes, plain_m.node_bytes, sizeof(m.node_bytes)));
+
+        order_data o = { 0, {0}, 0 };
+        fail_unless(art_set_iter(&t, set_order_cb, &o) == 0);
+        fail_unless(o.count == nlines);
+
+        // Set leaves are no art_leaf to hand out
+        fail_unless(art_minimum(&t) == NULL);
+        fail_unless(art_maximum(&t) == NULL);
+        art_leaf *l = art_minimum(&plain);
+        fail_unless(art_set_contains(&t, l->key, l->key_len));
+        fail_unless(art_search(&t, l->key, l->key_len) == NULL);
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(art_set_contains(&t, (unsigned char*)buf, len));
+            if (line % 2) {
+                fail_unless(art_set_delete(&t, (unsigned char*)buf, len) == 1);
+                fail_unless(art_set_delete(&t, (unsigned char*)buf, len) == 0);
+            }
+            line++;
+        }
+        fail_unless(art_compact(&t) == 0);
+
+        fseek(f, 0, SEEK_SET);
+        line = 1;
+        while (fgets(buf, sizeof buf, f)) {
+            len = strlen(buf);
+            buf[len-1] = '\0';
+            fail_unless(art_set_contains(&t, (unsigned char*)buf, len) == !(line % 2));
+            if (!(line % 2))
+                fail_unless(art_set_delete(&t, (unsigned char*)buf, len) == 1);
+            line++;
+        }
+        fclose(f);
+
+        art_memory_usage(&t, &m);
+        fail_unless(art_size(&t) == 0);
+        fail_unless(m.leaves == 0 && m.leaf_bytes == 0 && m.buckets == 0);
+
+        fail_unless(art_tree_destroy(&t) == 0);
+        fail_unless(art_tree_destroy(&plain) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_art_fixed_keys)
+{
+    art_tree t;
+    int res = art_tree_init_fixed(&t, 37, 0);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/uuid.txt", "r");
+
+    uintptr_t line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, (void*)line));
+        line++;
+    }
+
+    uint64_t out[] = {0, 0};
+    fail_unless(art_iter(&t, iter_cb, &out) == 0);
+    fail_unless(out[0] == line - 1);
+
+    // Leaves are the value and the key, no key length
+    art_mem_stats m;
+    art_memory_usage(&t, &m);
+    fail_unless(m.leaves == line - 1);
+    fail_unless(m.leaf_bytes == m.leaves * (sizeof(void*) + 37));
+    fail_unless(art_minimum(&t) == NULL);
+    fail_unless(art_maximum(&t) == NULL);
+
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless((uintptr_t)art_search(&t, (unsigned char*)buf, len) == line);
+
+        // Keys of other lengths are never there
+        fail_unless(art_search(&t, (unsigned char*)buf, len-1) == NULL);
+        fail_unless(art_delete(&t, (unsigned char*)buf, 8) == NULL);
+        buf[len-2]++;
+        fail_unless(art_search(&t, (unsigned char*)buf, len) == NULL);
+        buf[len-2]--;
+        if (line % 2)
+            fail_unless((uintptr_t)art_delete(&t, (unsigned char*)buf, len) == line);
+        line++;
+    }
+    fseek(f, 0, SEEK_SET);
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        uintptr_t val = (uintptr_t)art_search(&t, (unsigned char*)buf, len);
+        fail_unless(val == (line % 2 ? 0 : line));
+        line++;
+    }
+    fclose(f);
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+
+    // A map of 8 byte ids, values replaced and kept in place
+    int flags[] = { 0, ART_TREE_LEAF_BUCKETS, ART_TREE_REGION };
+    for (int j = 0; j < 3; j++) {
+        res = art_tree_init_fixed(&t, 8, flags[j]);
+        fail_unless(res == 0);
+        for (uint64_t i = 0; i < 100000; i++) {
+            uint64_t id = i * 2654435761ULL;
+            fail_unless(NULL == art_insert(&t, (unsigned char*)&id, 8, (void*)(uintptr_t)(i + 1)));
+        }
+        for (uint64_t i = 0; i < 100000; i += 2) {
+            uint64_t id = i * 2654435761ULL;
+            fail_unless((uintptr_t)art_insert(&t, (unsigned char*)&id, 8, (void*)(uintptr_t)(i + 2)) == i + 1);
+            fail_unless((uintptr_t)art_insert_no_replace(&t, (unsigned char*)&id, 8, (void*)1) == i + 2);
+        }
+        fail_unless(art_compact(&t) == 0);
+        for (uint64_t i = 0; i < 100000; i++) {
+            uint64_t id = i * 2654435761ULL;
+            fail_unless((uintptr_t)art_search(&t, (unsigned char*)&id, 8) == (i % 2 ? i + 1 : i + 2));
+            if (i % 3)
+                fail_unless((uintptr_t)art_delete(&t, (unsigned char*)&id, 8) == (i % 2 ? i + 1 : i + 2));
+        }
+        fail_unless(art_size(&t) == 33334);
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+
+    // A set of 8 byte ids, and misses one apart from them
+    res = art_tree_init_fixed(&t, 8, ART_TREE_SET | ART_TREE_LEAF_BUCKETS);
+    fail_unless(res == 0);
+    for (uint64_t i = 0; i < 100000; i++) {
+        uint64_t id = i * 2654435761ULL;
+        fail_unless(art_set_insert(&t, (unsigned char*)&id, 8) == 1);
+    }
+    for (uint64_t i = 0; i < 100000; i++) {
+        uint64_t id = i * 2654435761ULL;
+        fail_unless(art_set_contains(&t, (unsigned char*)&id, 8));
+        id++;
+        fail_unless(!art_set_contains(&t, (unsigned char*)&id, 8));
+    }
+    for (uint64_t i = 0; i < 100000; i++) {
+        uint64_t id = i * 2654435761ULL;
+        fail_unless(art_set_delete(&t, (unsigned char*)&id, 8) == 1);
+    }
+    fail_unless(art_size(&t) == 0);
+
+#ifdef NDEBUG
+    // Keys of the wrong length are turned away, debug builds assert
+    uint64_t id[3] = {1, 2, 3};
+    fail_unless(art_set_insert(&t, (unsigned char*)id, 8) == 1);
+    fail_unless(art_set_insert(&t, (unsigned char*)id, 20) == -1);
+    fail_unless(art_set_insert(&t, (unsigned char*)id, 4) == -1);
+    fail_unless(art_size(&t) == 1);
+    fail_unless(art_set_contains(&t, (unsigned char*)id, 8));
+    fail_unless(!art_set_contains(&t, (unsigned char*)id, 20));
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+
+    res = art_tree_init_fixed(&t, 8, 0);
+    fail_unless(res == 0);
+    fail_unless(art_insert(&t, (unsigned char*)id, 8, (void*)1) == NULL);
+    fail_unless(art_insert(&t, (unsigned char*)id, 16, (void*)2) == ART_KEY_REJECTED);
+    fail_unless(art_insert_no_replace(&t, (unsigned char*)id, 4, (void*)3) == ART_KEY_REJECTED);
+    fail_unless(art_size(&t) == 1);
+    fail_unless((uintptr_t)art_search(&t, (unsigned char*)id, 8) == 1);
+    fail_unless(art_search(&t, (unsigned char*)id, 16) == NULL);
+#endif
+    res = art_tree_destroy(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int exact_prefix_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    prefix_data *p = (prefix_data*)data;
+    fail_unless(p->count < p->max_count);
+    fail_unless(k_len == strlen(p->expected[p->count]) &&
+            !memcmp(k, p->expected[p->count], k_len),
+            "Key: %.*s Expect: %s", (int)k_len, k, p->expected[p->count]);
+    p->count++;
+    return 0;
+}
+
+START_TEST(test_art_iter_own_leaves)
+{
+    const char *keys[] = { "ab", "abc", "abd", "abdx", "b" };
+    const char *reversed[] = { "b", "abdx", "abd", "abc", "ab" };
+    const char **orders[] = { keys, reversed };
+    for (int i = 0; i < 2; i++) {
+        art_tree t;
+        int res = art_tree_init(&t);
+        fail_unless(res == 0);
+        for (int j = 0; j < 5; j++)
+            fail_unless(NULL == art_insert(&t, (unsigned char*)orders[i][j],
+                        strlen(orders[i][j]), NULL));
+
+        // Keys ending at a node come before the longer ones
+        prefix_data p = { 0, 5, keys };
+        fail_unless(art_iter(&t, exact_prefix_cb, &p) == 0);
+        fail_unless(p.count == 5, "Count: %d", p.count);
+
+        prefix_data p2 = { 0, 4, keys };
+        fail_unless(art_iter_prefix(&t, (unsigned char*)"ab", 2, exact_prefix_cb, &p2) == 0);
+        fail_unless(p2.count == 4, "Count: %d", p2.count);
+
+        prefix_data p3 = { 0, 2, keys + 2 };
+        fail_unless(art_iter_prefix(&t, (unsigned char*)"abd", 3, exact_prefix_cb, &p3) == 0);
+        fail_unless(p3.count == 2, "Count: %d", p3.count);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_art_full_node256_rep)
+{
+    int flags[] = { 0, ART_TREE_ARENA };
+    for (int i = 0; i < 2; i++) {
+        art_tree t;
+        int res = art_tree_init_flags(&t, flags[i]);
+        fail_unless(res == 0);
+
+        // A full Node256 wraps num_children to 0, deleting its
+        // own leaf must still find it another rep
+        unsigned char key[17] = "0123456789ABCDEF";
+        fail_unless(NULL == art_insert(&t, key, 16, (void*)1));
+        for (int c = 0; c < 256; c++) {
+            key[16] = c;
+            fail_unless(NULL == art_insert(&t, key, 17, (void*)(uintptr_t)(c + 2)));
+        }
+        fail_unless(art_delete(&t, key, 16) == (void*)1);
+        fail_unless(NULL == art_insert(&t, (unsigned char*)"0123456789ABCDEX", 16, (void*)1));
+
+        uint64_t out[] = {0, 0};
+        fail_unless(art_iter_prefix(&t, key, 16, iter_cb, &out) == 0);
+        fail_unless(out[0] == 256);
+        fail_unless(art_compact(&t) == 0);
+        art_tree_shrink(&t);
+
+        for (int c = 0; c < 256; c++) {
+            key[16] = c;
+            fail_unless((uintptr_t)art_search(&t, key, 17) == (uintptr_t)(c + 2));
+        }
+        fail_unless((uintptr_t)art_search(&t, (unsigned char*)"0123456789ABCDEX", 16) == 1);
+        fail_unless(art_size(&t) == 257);
+
+        res = art_tree_destroy(&t);
+        fail_unless(res == 0);
+    }
+}
+END_TEST